@@ -0,0 +1,222 @@
+// Hand-rolled benchmark harness for the tree family: ns/op for Insert
+// (random / sorted / zigzag), Erase, Exsist, Next/Prev and full in-order
+// iteration, with std::set as the reference column.
+//
+//   ./benchmark [max_size]     - sizes run 10^3 .. max_size (default 10^6)
+//
+// TSearchTree skips the sorted/zigzag insert patterns: without rebalancing
+// they degenerate the tree to a list and O(n^2) total time.
+#include "search_tree.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <random>
+#include <set>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+volatile int64_t g_sink = 0;
+
+double NsPerOp(Clock::time_point start, Clock::time_point stop, size_t ops) {
+    return std::chrono::duration<double, std::nano>(stop - start).count() / (double)ops;
+}
+
+void Report(const char* tree, const char* op, const char* pattern, size_t n, double ns) {
+    std::printf("%-16s %-12s %-8s %10zu %12.1f ns/op\n", tree, op, pattern, n, ns);
+}
+
+std::vector<int64_t> MakeKeys(size_t n, const char* pattern, std::mt19937_64& rng) {
+    std::vector<int64_t> keys(n);
+    for (size_t i = 0; i < n; ++i) {
+        keys[i] = (int64_t)i * 2;
+    }
+    if (std::string_view(pattern) == "random") {
+        std::shuffle(keys.begin(), keys.end(), rng);
+    } else if (std::string_view(pattern) == "zigzag") {
+        // alternate ends of the sorted order - worst case for naive insertion
+        std::vector<int64_t> zig;
+        zig.reserve(n);
+        size_t lo = 0, hi = n;
+        while (lo < hi) {
+            zig.push_back(keys[lo++]);
+            if (lo < hi) zig.push_back(keys[--hi]);
+        }
+        keys = zig;
+    }
+    return keys;
+}
+
+template<typename Tree>
+void BenchInsertPattern(const char* name, const char* pattern, size_t n, std::mt19937_64& rng) {
+    auto keys = MakeKeys(n, pattern, rng);
+    Tree tree;
+    auto start = Clock::now();
+    for (auto k : keys) {
+        tree.Insert(k);
+    }
+    Report(name, "Insert", pattern, n, NsPerOp(start, Clock::now(), n));
+}
+
+template<typename Tree>
+void BenchTree(const char* name, size_t n, bool safe_for_sorted, std::mt19937_64& rng) {
+    BenchInsertPattern<Tree>(name, "random", n, rng);
+    if (safe_for_sorted) {
+        BenchInsertPattern<Tree>(name, "sorted", n, rng);
+        BenchInsertPattern<Tree>(name, "zigzag", n, rng);
+    }
+
+    auto keys = MakeKeys(n, "random", rng);
+    Tree tree;
+    for (auto k : keys) {
+        tree.Insert(k);
+    }
+
+    auto start = Clock::now();
+    int64_t hits = 0;
+    for (auto k : keys) {
+        hits += tree.Exsist(k) + tree.Exsist(k + 1); // second probe always misses
+    }
+    g_sink = hits;
+    Report(name, "Exsist", "mixed", n, NsPerOp(start, Clock::now(), 2 * n));
+
+    // skewed probes (90% land on 64 hot keys) with the hot-key cache on
+    if constexpr (requires { tree.EnableHotKeyCache(); }) {
+        tree.EnableHotKeyCache(1024);
+        start = Clock::now();
+        hits = 0;
+        for (size_t i = 0; i < 2 * n; ++i) {
+            int64_t k = (rng() % 10 != 0) ? (int64_t)(rng() % 64) * 2 : keys[rng() % n];
+            hits += tree.Exsist(k);
+        }
+        g_sink = hits;
+        Report(name, "Exsist+cache", "skewed", n, NsPerOp(start, Clock::now(), 2 * n));
+        tree.DisableHotKeyCache();
+    }
+
+    start = Clock::now();
+    int64_t acc = 0;
+    for (auto k : keys) {
+        auto next = tree.Next(k);
+        if (next.IsValid()) acc += *next;
+        auto prev = tree.Prev(k);
+        if (prev.IsValid()) acc += *prev;
+    }
+    g_sink = acc;
+    Report(name, "Next/Prev", "random", n, NsPerOp(start, Clock::now(), 2 * n));
+
+    start = Clock::now();
+    acc = 0;
+    for (auto it = tree.Begin(); it != tree.End(); ++it) {
+        acc += *it;
+    }
+    g_sink = acc;
+    Report(name, "Iterate", "inorder", n, NsPerOp(start, Clock::now(), n));
+
+    if constexpr (requires { tree.Cursor(); }) {
+        start = Clock::now();
+        acc = 0;
+        for (auto cur = tree.Cursor(); cur.IsValid(); ++cur) {
+            acc += *cur;
+        }
+        g_sink = acc;
+        Report(name, "Cursor", "inorder", n, NsPerOp(start, Clock::now(), n));
+    }
+
+    std::shuffle(keys.begin(), keys.end(), rng);
+    start = Clock::now();
+    for (auto k : keys) {
+        tree.Erase(k);
+    }
+    Report(name, "Erase", "random", n, NsPerOp(start, Clock::now(), n));
+}
+
+// batch arrival: half the keys pre-loaded, the other half in one burst
+template<typename Tree>
+void BenchInsertBatch(const char* name, size_t n, std::mt19937_64& rng) {
+    auto keys = MakeKeys(n, "random", rng);
+    Tree tree;
+    for (size_t i = 0; i < n / 2; ++i) {
+        tree.Insert(keys[i]);
+    }
+    std::span<const int64_t> batch(keys.data() + n / 2, n - n / 2);
+    auto start = Clock::now();
+    tree.InsertBatch(batch);
+    Report(name, "InsertBatch", "random", n, NsPerOp(start, Clock::now(), batch.size()));
+}
+
+void BenchStdSet(size_t n, std::mt19937_64& rng) {
+    auto keys = MakeKeys(n, "random", rng);
+    std::set<int64_t> set;
+
+    auto start = Clock::now();
+    for (auto k : keys) {
+        set.insert(k);
+    }
+    Report("std::set", "Insert", "random", n, NsPerOp(start, Clock::now(), n));
+
+    start = Clock::now();
+    int64_t hits = 0;
+    for (auto k : keys) {
+        hits += set.count(k) + set.count(k + 1);
+    }
+    g_sink = hits;
+    Report("std::set", "Exsist", "mixed", n, NsPerOp(start, Clock::now(), 2 * n));
+
+    start = Clock::now();
+    int64_t acc = 0;
+    for (auto k : keys) {
+        auto next = set.upper_bound(k);
+        if (next != set.end()) acc += *next;
+        auto prev = set.lower_bound(k);
+        if (prev != set.begin()) acc += *std::prev(prev);
+    }
+    g_sink = acc;
+    Report("std::set", "Next/Prev", "random", n, NsPerOp(start, Clock::now(), 2 * n));
+
+    start = Clock::now();
+    acc = 0;
+    for (auto v : set) {
+        acc += v;
+    }
+    g_sink = acc;
+    Report("std::set", "Iterate", "inorder", n, NsPerOp(start, Clock::now(), n));
+
+    std::shuffle(keys.begin(), keys.end(), rng);
+    start = Clock::now();
+    for (auto k : keys) {
+        set.erase(k);
+    }
+    Report("std::set", "Erase", "random", n, NsPerOp(start, Clock::now(), n));
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t max_size = 1000 * 1000;
+    if (argc > 1) {
+        max_size = std::strtoull(argv[1], nullptr, 10);
+    }
+
+    std::mt19937_64 rng(20240101);
+    for (size_t n = 1000; n <= max_size; n *= 10) {
+        // a degenerate TSearchTree is also too deep for its recursive Find
+        bool plain_tree_ok = n <= 100 * 1000;
+        if (plain_tree_ok) {
+            BenchTree<TSearchTree<int64_t, false>>("TSearchTree", n, /*safe_for_sorted=*/false, rng);
+        }
+        BenchTree<TAvlTree<int64_t, false>>("TAvlTree", n, true, rng);
+        BenchInsertBatch<TAvlTree<int64_t, false>>("TAvlTree", n, rng);
+        BenchTree<TAvlTreeWithSize<int64_t, false>>("TAvlTreeWithSize", n, true, rng);
+        BenchTree<TArenaAvlTree<int64_t, false>>("TArenaAvlTree", n, true, rng);
+        // unbalanced like TSearchTree, so only the random pattern is fair
+        BenchTree<TCompactSearchTree<int64_t>>("TCompactSearch", n, /*safe_for_sorted=*/false, rng);
+        BenchTree<TLeafArrayTree<int64_t>>("TLeafArray", n, true, rng);
+        BenchStdSet(n, rng);
+        std::printf("\n");
+    }
+    return 0;
+}
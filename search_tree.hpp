@@ -0,0 +1,3050 @@
+#pragma once
+
+#include <iostream>
+#include <memory>
+#include <string>
+#include <functional>
+#include <vector>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <algorithm>
+#include <span>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <cstring>
+
+
+// On-disk layout of a flattened tree: header + the keys in sorted order.
+// The sorted array IS the tree (an implicit perfectly balanced one), so a
+// view can binary-search it straight out of a memory-mapped file.
+struct TFlatTreeHeader {
+    static constexpr char kMagic[8] = {'A', 'V', 'L', 'F', 'L', 'A', 'T', '1'};
+
+    char magic_[8];
+    uint64_t count_;
+    uint64_t value_size_;
+};
+
+// Read-only tree view over a serialized buffer (typically mmap'ed): Exsist,
+// Next/Prev and iteration are served directly from the mapped keys, no Node
+// objects are ever materialized, so "loading" a 50M-key tree is one mmap.
+template<typename T>
+class TFlatTreeView {
+    static_assert(std::is_trivially_copyable_v<T>,
+                  "the flat format stores raw value bytes");
+
+  public:
+    TFlatTreeView() {}
+
+    // false if the buffer is not a valid dump for this T
+    bool Attach(const void* data, size_t bytes) {
+        values_ = nullptr;
+        count_ = 0;
+        if (bytes < sizeof(TFlatTreeHeader)) {
+            return false;
+        }
+        TFlatTreeHeader header;
+        std::memcpy(&header, data, sizeof(header));
+        if (std::memcmp(header.magic_, TFlatTreeHeader::kMagic, sizeof(header.magic_)) != 0 ||
+            header.value_size_ != sizeof(T) ||
+            // division, not multiplication: count_ is untrusted and
+            // count_ * sizeof(T) can wrap around to something small
+            header.count_ > (bytes - sizeof(header)) / sizeof(T)) {
+            return false;
+        }
+        values_ = reinterpret_cast<const T*>(static_cast<const char*>(data) + sizeof(header));
+        count_ = header.count_;
+        return true;
+    }
+
+    size_t Size() const {
+        return count_;
+    }
+    bool Empty() const {
+        return count_ == 0;
+    }
+
+    bool Exsist(const T& value) const {
+        return std::binary_search(values_, values_ + count_, value);
+    }
+    // smallest key > value / largest key < value; nullptr if none
+    const T* Next(const T& value) const {
+        const T* it = std::upper_bound(values_, values_ + count_, value);
+        return it == values_ + count_ ? nullptr : it;
+    }
+    const T* Prev(const T& value) const {
+        const T* it = std::lower_bound(values_, values_ + count_, value);
+        return it == values_ ? nullptr : it - 1;
+    }
+
+    const T* begin() const { return values_; }
+    const T* end() const { return values_ + count_; }
+
+  private:
+    const T* values_ = nullptr;
+    size_t count_ = 0;
+};
+
+
+class TSlabArena {
+  public:
+    static const size_t kDefaultBlockSize = 1 << 20;
+
+    explicit TSlabArena(size_t block_size = kDefaultBlockSize) : block_size_(block_size) {}
+
+    TSlabArena(const TSlabArena&) = delete;
+    TSlabArena& operator=(const TSlabArena&) = delete;
+
+    void* Allocate(size_t bytes, size_t align) {
+        size_t aligned = (offset_ + align - 1) & ~(align - 1);
+        if (blocks_.empty() || aligned + bytes > block_size_) {
+            blocks_.push_back(std::make_unique<char[]>(std::max(bytes, block_size_)));
+            aligned = 0;
+        }
+        offset_ = aligned + bytes;
+        return blocks_.back().get() + aligned;
+    }
+
+    size_t AllocatedBytes() const {
+        return blocks_.size() * block_size_;
+    }
+
+  private:
+    std::vector<std::unique_ptr<char[]>> blocks_;
+    size_t offset_ = 0;
+    size_t block_size_;
+};
+
+// std-style allocator over TSlabArena: Allocate bumps a pointer inside the
+// current slab, deallocate is a no-op - all memory is returned at once when
+// the arena is destroyed.
+template<typename U>
+class TArenaAllocator {
+  public:
+    using value_type = U;
+
+    explicit TArenaAllocator(TSlabArena* arena) : arena_(arena) {}
+    template<typename V>
+    TArenaAllocator(const TArenaAllocator<V>& other) : arena_(other.arena_) {}
+
+    U* allocate(size_t n) {
+        return static_cast<U*>(arena_->Allocate(n * sizeof(U), alignof(U)));
+    }
+    void deallocate(U*, size_t) {}
+
+    friend bool operator==(const TArenaAllocator& a, const TArenaAllocator& b) {
+        return a.arena_ == b.arena_;
+    }
+    friend bool operator!=(const TArenaAllocator& a, const TArenaAllocator& b) {
+        return a.arena_ != b.arena_;
+    }
+
+    TSlabArena* arena_;
+};
+
+
+// Workload counters for sizing experiments: nodes allocated and freed by
+// this tree's own operations and rotations performed. Compiled in only
+// under -DSEARCH_TREE_STATS; otherwise an empty struct with no-op hooks that
+// the optimizer deletes, so release builds pay nothing. The counters are a
+// work ledger, not a live-node census (JoinWith/SplitOff move nodes between
+// trees without touching them) - MemoryUsage() walks the tree for exact
+// live figures.
+#ifdef SEARCH_TREE_STATS
+struct TTreeStats {
+    size_t nodes_allocated_ = 0;
+    size_t nodes_freed_ = 0;
+    size_t rotations_ = 0;
+
+    static constexpr bool kEnabled = true;
+    void OnNodesAllocated(size_t n) { nodes_allocated_ += n; }
+    void OnNodesFreed(size_t n) { nodes_freed_ += n; }
+    void OnRotation() { rotations_ += 1; }
+};
+#else
+struct TTreeStats {
+    static constexpr size_t nodes_allocated_ = 0;
+    static constexpr size_t nodes_freed_ = 0;
+    static constexpr size_t rotations_ = 0;
+
+    static constexpr bool kEnabled = false;
+    void OnNodesAllocated(size_t) {}
+    void OnNodesFreed(size_t) {}
+    void OnRotation() {}
+};
+#endif
+
+
+// Nodes are CRTP too: links are typed as the final node type (Self), so the
+// trees below never need dynamic_pointer_cast to reach height_/size_.
+template<typename T, typename Self>
+struct TNodeBase {
+    T value_;
+    std::shared_ptr<Self> left_;
+    std::shared_ptr<Self> right_;
+    // raw observer, not a weak_ptr: the parent owns its children through
+    // left_/right_, so a node reachable from the tree never outlives its
+    // parent, and following the link is a plain load instead of a
+    // weak_ptr::lock (an atomic RMW on the control block)
+    Self* parent_ = nullptr;
+    size_t cnt_ = 1;
+
+    bool operator<(const TNodeBase& other) {
+        return value_ < other.value_;
+    }
+
+    explicit TNodeBase() {}
+    template<typename... Args>
+    TNodeBase(Args&&... args) : value_(std::forward<Args>(args)...) {}
+};
+
+template<typename T>
+struct TPlainNode : TNodeBase<T, TPlainNode<T>> {
+    using TNodeBase<T, TPlainNode<T>>::TNodeBase;
+};
+
+template<typename T>
+struct TAvlNode : TNodeBase<T, TAvlNode<T>> {
+    using TNodeBase<T, TAvlNode<T>>::TNodeBase;
+
+    size_t height_ = 1;
+};
+
+template<typename T>
+struct TAvlNodeWithSize : TNodeBase<T, TAvlNodeWithSize<T>> {
+    using TNodeBase<T, TAvlNodeWithSize<T>>::TNodeBase;
+
+    size_t height_ = 1;
+    size_t size_ = 1;
+};
+
+// A is the aggregate type of the monoid the tree is augmented with; agg_
+// covers the whole subtree and is renewed wherever height_ is
+template<typename T, typename A>
+struct TAvlNodeAugmented : TNodeBase<T, TAvlNodeAugmented<T, A>> {
+    using TNodeBase<T, TAvlNodeAugmented<T, A>>::TNodeBase;
+
+    size_t height_ = 1;
+    A agg_{};
+};
+
+
+// CRTP base of the whole family. Impl is the concrete tree; it customizes
+// node creation and rebalancing by shadowing the hooks below (Balance,
+// CreateNode, SubtreeHeight, RenewNodesHeight, HelpOutput), which the base
+// reaches through Self() - a compile-time dispatch, no vtable and no RTTI.
+// All ordering goes through Compare; when it is transparent (declares
+// is_transparent, e.g. std::less<>), the lookup methods accept any key type
+// the comparator can handle without materializing a T.
+template<typename T, bool IsMultiSet, typename NodeT, typename Impl, typename Compare = std::less<T>>
+class TSearchTreeBase {
+  protected:
+    using Node = NodeT;
+
+    [[no_unique_address]] Compare comp_;
+
+    template<typename A, typename B>
+    bool Less(const A& a, const B& b) const {
+        return comp_(a, b);
+    }
+    template<typename A, typename B>
+    bool Equal(const A& a, const B& b) const {
+        return !comp_(a, b) && !comp_(b, a);
+    }
+
+    Impl& Self() {
+        return static_cast<Impl&>(*this);
+    }
+    const Impl& Self() const {
+        return static_cast<const Impl&>(*this);
+    }
+
+  public:
+    TSearchTreeBase() {}
+
+    friend std::ostream& operator<<(std::ostream& os, const TSearchTreeBase& tree) {
+        return tree.Print(os);
+    }
+
+    void Insert(const T& value) {
+        InsertValue(value);
+    }
+    void Insert(T&& value) {
+        InsertValue(std::move(value));
+    }
+    // Constructs the value in place inside a fresh node; if the key turns out
+    // to be a duplicate the node is simply dropped.
+    template<typename... Args>
+    void Emplace(Args&&... args) {
+        auto new_node = Self().CreateNode(std::forward<Args>(args)...);
+        stats_.OnNodesAllocated(1);
+        if (!root_) {
+            root_ = new_node;
+            size_ += 1;
+            min_ = root_;
+            max_ = root_;
+            return;
+        }
+        auto cur_node = root_;
+        while (true) {
+            if (Equal(cur_node->value_, new_node->value_)) {
+                InsertIfFound(cur_node);
+                stats_.OnNodesFreed(1); // the speculative node is dropped
+                return;
+            }
+            auto& son = Less(new_node->value_, cur_node->value_) ? cur_node->left_ : cur_node->right_;
+            if (!son) {
+                son = new_node;
+                son->parent_ = cur_node.get();
+                size_ += 1;
+                RenewCachedExtremes(son);
+                RebalanceUpwards(cur_node.get());
+                return;
+            }
+            cur_node = son;
+        }
+    }
+    // Removes one copy of the key: a multiset node with cnt_ > 1 just
+    // decrements (and reweights the ancestor aggregates); the last copy
+    // unlinks the node as before.
+    void Erase(const T& value) {
+        auto node = FindNodeShared(value);
+        if (!node) {
+            return;
+        }
+        if (IsMultiSet && node->cnt_ > 1) {
+            node->cnt_ -= 1;
+            size_ -= 1;
+            RenewAggregatesUpwards(node);
+            return;
+        }
+        EraseNode(node);
+    }
+    // drops the key with all its copies in one unlink
+    void EraseAll(const T& value) {
+        auto node = FindNodeShared(value);
+        if (node) {
+            EraseNode(node);
+        }
+    }
+    // multiplicity of the key - cnt_ for a multiset, 0 or 1 for a set; O(log n)
+    size_t Count(const T& value) const {
+        const Node* node = FindNode(value);
+        return node ? node->cnt_ : 0;
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    size_t Count(const K& value) const {
+        const Node* node = FindNode(value);
+        return node ? node->cnt_ : 0;
+    }
+    bool Exsist(const T& value) const {
+        return FindNode(value) != nullptr;
+    }
+
+    // Tombstones the key in O(log n) with no restructuring: the node stays
+    // in place with cnt_ = 0 and every lookup and iteration path skips it,
+    // so an erase burst is a pure descent-and-mark with no rotation cascade.
+    // Inserting the key again just revives the node. For compaction against
+    // a live snapshot see TCowAvlTree.
+    void EraseLazy(const T& value) {
+        auto node = FindNodeShared(value); // already-dead nodes come back null
+        if (!node) {
+            return;
+        }
+        size_ -= LiveCopies(node); // a multiset tombstone buries every copy
+        node->cnt_ = 0;
+        dead_ += 1;
+        RenewAggregatesUpwards(node);
+    }
+    // Rebuilds the tree without the tombstoned nodes in one O(n) balanced
+    // pass - the deferred cost of the EraseLazy marks. No-op when clean.
+    void Compact() {
+        if (dead_ == 0) {
+            return;
+        }
+        std::vector<T> alive;
+        alive.reserve(size_);
+        CollectInOrder(root_, alive);
+        BuildFromSorted(alive.begin(), alive.end()); // resets dead_
+    }
+    size_t DeadCount() const {
+        return dead_;
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    bool Exsist(const K& value) const {
+        return FindNode(value) != nullptr;
+    }
+
+    // Direct-mapped cache of recently hit nodes, consulted by Exsist before
+    // descending from root_: under key skew most probes become one hash and
+    // one equality check. slots is rounded up to a power of two. The cache
+    // holds raw pointers and is dropped wholesale (via an epoch bump)
+    // whenever nodes can die or leave the tree - erase, rebuilds, join/split.
+    void EnableHotKeyCache(size_t slots = 1024) {
+        static_assert(kHashableKey, "the hot-key cache needs std::hash<T>");
+        size_t rounded = 1;
+        while (rounded < slots) {
+            rounded *= 2;
+        }
+        hot_cache_.assign(rounded, {});
+    }
+    void DisableHotKeyCache() {
+        hot_cache_.clear();
+        hot_cache_.shrink_to_fit();
+    }
+
+    // Builds a perfectly balanced tree from an already sorted range in O(n),
+    // replacing the current contents. Goes through CreateNode, so every tree
+    // variant gets its own node type with correct height_/size_ fields; equal
+    // neighbours collapse into cnt_ when IsMultiSet and are dropped otherwise.
+    template<typename InputIt>
+    void BuildFromSorted(InputIt first, InputIt last) {
+        auto packed = PackSorted(first, last);
+        InvalidateHotCache();
+        if constexpr (TTreeStats::kEnabled) {
+            stats_.OnNodesFreed(CountNodes(root_)); // the old tree is dropped
+        }
+        stats_.OnNodesAllocated(packed.size());
+        dead_ = 0;
+        root_ = BuildRange(packed, 0, packed.size());
+        size_ = PackedTotal(packed);
+        min_ = FindMin(root_);
+        max_ = FindMax(root_);
+    }
+    void BuildFromSorted(const std::vector<T>& values) {
+        BuildFromSorted(values.begin(), values.end());
+    }
+
+    // Parallel counterpart of BuildFromSorted. The two halves under any node
+    // are completely independent, so they fork onto their own threads until
+    // roughly `threads` workers are busy, then each worker finishes its range
+    // with the serial BuildRange. Small inputs, single-threaded requests and
+    // trees whose CreateNode is not thread-safe (the arena tree) take the
+    // serial path unchanged.
+    template<typename InputIt>
+    void BuildFromSortedParallel(InputIt first, InputIt last,
+                                 size_t threads = std::thread::hardware_concurrency()) {
+        auto packed = PackSorted(first, last);
+        InvalidateHotCache();
+        if constexpr (TTreeStats::kEnabled) {
+            stats_.OnNodesFreed(CountNodes(root_));
+        }
+        stats_.OnNodesAllocated(packed.size());
+        dead_ = 0;
+        if (Impl::kThreadSafeCreateNode && threads > 1 && packed.size() >= kParallelBuildCutoff) {
+            root_ = BuildRangeParallel(packed, 0, packed.size(), threads);
+        } else {
+            root_ = BuildRange(packed, 0, packed.size());
+        }
+        size_ = PackedTotal(packed);
+        min_ = FindMin(root_);
+        max_ = FindMax(root_);
+    }
+    void BuildFromSortedParallel(const std::vector<T>& values,
+                                 size_t threads = std::thread::hardware_concurrency()) {
+        BuildFromSortedParallel(values.begin(), values.end(), threads);
+    }
+
+    // Visits every key using up to `threads` workers. The tree is cut into
+    // roughly even disjoint subtrees - the largest part is split first, by
+    // size_ when the nodes track it, by height otherwise - and each worker
+    // walks one subtree, so workers never touch the same node. The visitor is
+    // called from several threads at once and must be thread-safe; keys
+    // within one subtree arrive in order, subtrees run concurrently.
+    template<typename Visitor>
+    void ParallelVisit(Visitor visitor, size_t threads = std::thread::hardware_concurrency()) const {
+        if (!root_) {
+            return;
+        }
+        if (threads <= 1) {
+            VisitInOrder(root_, visitor);
+            return;
+        }
+        std::vector<std::shared_ptr<Node>> parts{root_};
+        std::vector<std::shared_ptr<Node>> cut; // split nodes, visited inline below
+        while (parts.size() < threads) {
+            size_t best = parts.size();
+            size_t best_weight = 1; // a lone leaf is not worth splitting
+            for (size_t i = 0; i < parts.size(); ++i) {
+                size_t weight = PartWeight(parts[i]);
+                if (weight > best_weight) {
+                    best_weight = weight;
+                    best = i;
+                }
+            }
+            if (best == parts.size()) {
+                break; // only leaves left
+            }
+            auto node = parts[best];
+            parts.erase(parts.begin() + best);
+            cut.push_back(node);
+            if (node->left_) parts.push_back(node->left_);
+            if (node->right_) parts.push_back(node->right_);
+        }
+        std::vector<std::thread> workers;
+        workers.reserve(parts.size());
+        for (const auto& part : parts) {
+            workers.emplace_back([&part, &visitor] {
+                VisitInOrder(part, visitor);
+            });
+        }
+        for (const auto& node : cut) {
+            for (size_t i = 0; i < LiveCopies(node); ++i) {
+                visitor(node->value_);
+            }
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+    }
+
+    // Bulk insert: sorts the batch, streams the current contents out in one
+    // in-order pass, merges the two sorted sequences and rebuilds perfectly
+    // balanced - O(n + m log m) instead of m incremental descents with
+    // rotation churn. Small batches fall back to the per-key path.
+    void InsertBatch(std::span<const T> batch) {
+        if (batch.empty()) {
+            return;
+        }
+        if (batch.size() < size_ / 64) {
+            for (const auto& value : batch) {
+                Insert(value);
+            }
+            return;
+        }
+        std::vector<T> sorted_batch(batch.begin(), batch.end());
+        std::sort(sorted_batch.begin(), sorted_batch.end(), comp_);
+
+        std::vector<T> current;
+        current.reserve(size_);
+        CollectInOrder(root_, current);
+
+        std::vector<T> merged;
+        merged.reserve(current.size() + sorted_batch.size());
+        std::merge(current.begin(), current.end(),
+                   sorted_batch.begin(), sorted_batch.end(),
+                   std::back_inserter(merged), comp_);
+        BuildFromSorted(merged.begin(), merged.end());
+    }
+
+    // Dumps the tree in the flat sorted format (see TFlatTreeHeader): one
+    // in-order pass, restartable either through Deserialize or by attaching a
+    // TFlatTreeView directly over the mmap'ed bytes.
+    void Serialize(std::ostream& os) const {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "the flat format stores raw value bytes");
+        std::vector<T> values;
+        values.reserve(size_);
+        CollectInOrder(root_, values);
+
+        TFlatTreeHeader header;
+        std::memcpy(header.magic_, TFlatTreeHeader::kMagic, sizeof(header.magic_));
+        header.count_ = values.size();
+        header.value_size_ = sizeof(T);
+        os.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        os.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+    // false on a malformed dump; on success the contents are replaced via the
+    // O(n) balanced build
+    bool Deserialize(std::istream& is) {
+        static_assert(std::is_trivially_copyable_v<T>,
+                      "the flat format stores raw value bytes");
+        TFlatTreeHeader header;
+        if (!is.read(reinterpret_cast<char*>(&header), sizeof(header)) ||
+            std::memcmp(header.magic_, TFlatTreeHeader::kMagic, sizeof(header.magic_)) != 0 ||
+            header.value_size_ != sizeof(T)) {
+            return false;
+        }
+        // count_ is untrusted: grow the buffer only as fast as the stream
+        // actually delivers, so a forged count fails at end-of-stream instead
+        // of attempting a huge allocation
+        std::vector<T> values;
+        constexpr size_t kReadChunk = (1 << 20) / sizeof(T) + 1;
+        while (values.size() < header.count_) {
+            size_t old_size = values.size();
+            size_t take = std::min<size_t>(header.count_ - old_size, kReadChunk);
+            values.resize(old_size + take);
+            if (!is.read(reinterpret_cast<char*>(values.data() + old_size), take * sizeof(T))) {
+                return false;
+            }
+        }
+        BuildFromSorted(values.begin(), values.end());
+        return true;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // O(1), allocation-free thanks to the cached extremum nodes; the tree
+    // must not be empty
+    const T& Min() const {
+        const Node* node = min_.get();
+        while (node->cnt_ == 0) {
+            node = SuccessorNode(node);
+        }
+        return node->value_;
+    }
+    const T& Max() const {
+        const Node* node = max_.get();
+        while (node->cnt_ == 0) {
+            node = PredecessorNode(node);
+        }
+        return node->value_;
+    }
+
+    // Byte accounting for capacity planning, one O(n) walk: the T payloads,
+    // the per-node structure around them (links, multiplicity, balance and
+    // aggregate fields), and the control block make_shared / allocate_shared
+    // co-allocates in front of every node.
+    struct TMemoryUsage {
+        size_t node_count_ = 0;
+        size_t payload_bytes_ = 0;
+        size_t node_overhead_bytes_ = 0;
+        size_t control_block_bytes_ = 0;
+
+        size_t Total() const {
+            return payload_bytes_ + node_overhead_bytes_ + control_block_bytes_;
+        }
+    };
+
+    TMemoryUsage MemoryUsage() const {
+        TMemoryUsage usage;
+        usage.node_count_ = CountNodes(root_);
+        usage.payload_bytes_ = usage.node_count_ * sizeof(T);
+        usage.node_overhead_bytes_ = usage.node_count_ * (sizeof(Node) - sizeof(T));
+        usage.control_block_bytes_ = usage.node_count_ * kControlBlockBytes;
+        return usage;
+    }
+
+    const TTreeStats& Stats() const {
+        return stats_;
+    }
+
+    // One-line health summary - size, height, widest level, extrema - in one
+    // level-order sweep that enqueues only real nodes, so it is safe to call
+    // on any tree from a live process. Handles the empty tree.
+    std::ostream& DumpStats(std::ostream& os) const {
+        os << "size=" << size_;
+        if (!root_) {
+            return os << " (empty)\n";
+        }
+        std::vector<const Node*> level{root_.get()};
+        std::vector<const Node*> next;
+        size_t height = 0;
+        size_t widest = 0;
+        while (!level.empty()) {
+            height += 1;
+            widest = std::max(widest, level.size());
+            next.clear();
+            for (const Node* node : level) {
+                if (node->left_) next.push_back(node->left_.get());
+                if (node->right_) next.push_back(node->right_.get());
+            }
+            level.swap(next); // reuse both buffers across levels
+        }
+        os << " height=" << height << " widest_level=" << widest
+           << " min=" << min_->value_ << " max=" << max_->value_ << "\n";
+        return os;
+    }
+
+    // Level-order dump of the top max_depth levels, one line per level, each
+    // node annotated by the tree's HelpOutput hook. Only real nodes are ever
+    // buffered, so memory is bounded by the widest printed level instead of
+    // 2^height, and the depth cap keeps the output finite on huge trees.
+    std::ostream& DumpLevels(std::ostream& os, size_t max_depth = 8) const {
+        if (!root_) {
+            return os << "(empty)\n";
+        }
+        std::vector<std::shared_ptr<Node>> level{root_};
+        std::vector<std::shared_ptr<Node>> next;
+        size_t printed = 0;
+        for (size_t depth = 0; depth < max_depth && !level.empty(); ++depth) {
+            for (const auto& node : level) {
+                os << node->value_ << "(" << Self().HelpOutput(node) << ") | ";
+            }
+            os << "\n";
+            for (const auto& node : level) {
+                printed += LiveCopies(node);
+            }
+            next.clear();
+            for (const auto& node : level) {
+                if (node->left_) next.push_back(node->left_);
+                if (node->right_) next.push_back(node->right_);
+            }
+            level.swap(next);
+        }
+        if (printed < size_) {
+            os << "... " << (size_ - printed) << " more nodes below depth " << max_depth << "\n";
+        }
+        return os;
+    }
+
+    // Full structural audit in one O(n) pass: strict BST order (through the
+    // comparator), parent_ back-links, the element count against Size(), the
+    // cached extrema, and every per-node invariant the concrete tree
+    // maintains (AVL heights and balance, subtree sizes) via the
+    // ValidateNode hook. Returns false on any violation; meant as the safety
+    // net under the stress target and debug assertions.
+    bool Validate() const {
+        if (!root_) {
+            return size_ == 0 && !min_ && !max_;
+        }
+        if (root_->parent_) {
+            return false;
+        }
+        bool ok = true;
+        size_t elements = 0;
+        const Node* prev = nullptr;
+        ValidateSubtree(root_, ok, elements, prev);
+        return ok && elements == size_ && min_ == FindMin(root_) && max_ == FindMax(root_);
+    }
+
+  protected:
+    // returns the subtree height; order/parent checks accumulate into ok,
+    // live copies into elements, prev walks the in-order predecessor
+    size_t ValidateSubtree(const std::shared_ptr<Node>& node, bool& ok,
+                           size_t& elements, const Node*& prev) const {
+        if (!node || !ok) {
+            return 0;
+        }
+        size_t left_height = ValidateSubtree(node->left_, ok, elements, prev);
+        if (prev && !Less(prev->value_, node->value_)) {
+            ok = false; // out of order, or the same key in two nodes
+        }
+        prev = node.get();
+        elements += LiveCopies(node);
+        if ((node->left_ && node->left_->parent_ != node.get()) ||
+            (node->right_ && node->right_->parent_ != node.get())) {
+            ok = false;
+        }
+        size_t right_height = ValidateSubtree(node->right_, ok, elements, prev);
+        if (!Self().ValidateNode(node, left_height, right_height)) {
+            ok = false;
+        }
+        return std::max(left_height, right_height) + 1;
+    }
+
+    // per-node invariant hook; the plain search tree maintains none
+    bool ValidateNode(const std::shared_ptr<Node>& node, size_t left_height, size_t right_height) const {
+        return true;
+    }
+
+    // Unlinks the node in one structural pass: a two-child node is replaced
+    // by its in-order successor via pointer relinking, so the value itself is
+    // never copied or swapped - only links move. Rebalancing starts at the
+    // deepest node whose subtree changed.
+    void EraseNode(std::shared_ptr<Node> node) {
+        InvalidateHotCache();
+        stats_.OnNodesFreed(1);
+        bool was_min = (node == min_);
+        bool was_max = (node == max_);
+        Node* rebalance_from = nullptr;
+        Node* parent = node->parent_;
+        if (node->left_ && node->right_) {
+            // the successor is the min of the right subtree; it has no left son
+            auto succ = FindMin(node->right_);
+            Node* succ_parent = succ->parent_;
+            if (succ_parent == node.get()) {
+                // succ is node->right_ itself and keeps its right subtree
+                rebalance_from = succ.get();
+            } else {
+                (succ_parent->left_ == succ ? succ_parent->left_ : succ_parent->right_) = succ->right_;
+                if (succ->right_) succ->right_->parent_ = succ_parent;
+                succ->right_ = node->right_;
+                succ->right_->parent_ = succ.get();
+                rebalance_from = succ_parent;
+            }
+            succ->left_ = node->left_;
+            succ->left_->parent_ = succ.get();
+            // succ takes over node's position, so it must take over node's
+            // aggregates too: the rebalance walk below starts deeper and may
+            // legitimately stop before re-deriving them up here
+            if constexpr (requires { succ->height_; }) {
+                succ->height_ = node->height_;
+            }
+            if constexpr (requires { succ->size_; }) {
+                succ->size_ = node->size_;
+            }
+            if (parent) {
+                (parent->left_ == node ? parent->left_ : parent->right_) = succ;
+                succ->parent_ = parent;
+            } else {
+                root_ = succ;
+                succ->parent_ = nullptr;
+            }
+        } else {
+            auto child = node->left_ ? node->left_ : node->right_;
+            if (child) {
+                child->parent_ = parent;
+            }
+            if (parent) {
+                (parent->left_ == node ? parent->left_ : parent->right_) = child;
+                rebalance_from = parent;
+            } else {
+                root_ = child;
+                rebalance_from = child.get();
+            }
+        }
+        size_ -= LiveCopies(node);
+        // re-descend only when the extremum itself went away
+        if (was_min) {
+            min_ = FindMin(root_);
+        }
+        if (was_max) {
+            max_ = FindMax(root_);
+        }
+        RebalanceUpwards(rebalance_from);
+    }
+
+    // new_node was just attached as a leaf
+    void RenewCachedExtremes(const std::shared_ptr<Node>& new_node) {
+        if (!min_ || Less(new_node->value_, min_->value_)) {
+            min_ = new_node;
+        }
+        if (!max_ || Less(max_->value_, new_node->value_)) {
+            max_ = new_node;
+        }
+    }
+
+    static bool IsLeftSon(const Node* cur_node) {
+        const Node* parent = cur_node->parent_;
+        return parent && parent->left_.get() == cur_node;
+    }
+    static bool IsRightSon(const Node* cur_node) {
+        const Node* parent = cur_node->parent_;
+        return parent && parent->right_.get() == cur_node;
+    }
+
+    // Default hooks: a plain search tree does not rebalance and tracks no
+    // per-subtree info. Concrete trees shadow these.
+    std::shared_ptr<Node> Balance(std::shared_ptr<Node> node) {
+        return node;
+    }
+    template<typename... Args>
+    std::shared_ptr<Node> CreateNode(Args&&... args) {
+        return std::make_shared<Node>(std::forward<Args>(args)...);
+    }
+    size_t SubtreeHeight(const std::shared_ptr<Node>& node) const {
+        return 0;
+    }
+    void RenewNodesHeight(const std::shared_ptr<Node>& node) {
+    }
+    // Trees that maintain per-subtree aggregates (e.g. sizes) shadow this with
+    // true so the rebalance walk reaches the root even when heights settle.
+    static constexpr bool kMaintainsSubtreeInfo = false;
+    // CreateNode goes through the global allocator and may run on several
+    // build threads at once; trees with a private arena shadow this with false.
+    static constexpr bool kThreadSafeCreateNode = true;
+    // Join/split relink nodes from one tree into another, which is only sound
+    // when nodes come from the global heap. Trees whose nodes live in a
+    // tree-private arena shadow this with false: their nodes (and control
+    // blocks) are freed together with the owning tree's slabs, so a node
+    // relinked into another tree would dangle as soon as its owner dies.
+    static constexpr bool kTransferableNodes = true;
+
+    // Walks the parent_ chain from the deepest changed node, rebalancing each
+    // ancestor and relinking rotation results, and stops as soon as the
+    // subtree kept both its root and its height - everything above is intact.
+    void RebalanceUpwards(Node* node) {
+        while (node) {
+            Node* parent = node->parent_;
+            // the owning child slot (or root_) is both the shared handle the
+            // rotation hooks need and the link a rotation result replaces
+            std::shared_ptr<Node>& link = !parent ? root_
+                : (parent->left_.get() == node ? parent->left_ : parent->right_);
+            auto old_height = Self().SubtreeHeight(link);
+            auto new_node = Self().Balance(link);
+            if (new_node.get() != node) {
+                link = new_node;
+                new_node->parent_ = parent;
+            }
+            if constexpr (!Impl::kMaintainsSubtreeInfo) {
+                if (new_node.get() == node && Self().SubtreeHeight(new_node) == old_height) {
+                    break;
+                }
+            }
+            node = parent;
+        }
+    }
+
+    // Shared by the copy and move Insert overloads: navigates by the value
+    // first, so a duplicate key does not allocate a node at all, and the
+    // value is copied/moved exactly once at the attach point.
+    template<typename V>
+    void InsertValue(V&& value) {
+        if (!root_) {
+            root_ = Self().CreateNode(std::forward<V>(value));
+            stats_.OnNodesAllocated(1);
+            size_ += 1;
+            min_ = root_;
+            max_ = root_;
+            return;
+        }
+        auto cur_node = root_;
+        while (true) {
+            if (Equal(cur_node->value_, value)) {
+                InsertIfFound(cur_node);
+                return;
+            }
+            auto& son = Less(value, cur_node->value_) ? cur_node->left_ : cur_node->right_;
+            if (!son) {
+                son = Self().CreateNode(std::forward<V>(value));
+                stats_.OnNodesAllocated(1);
+                son->parent_ = cur_node.get();
+                size_ += 1;
+                RenewCachedExtremes(son);
+                RebalanceUpwards(cur_node.get());
+                return;
+            }
+            cur_node = son;
+        }
+    }
+
+    void InsertIfFound(const std::shared_ptr<Node>& cur_node) {
+        if (cur_node->cnt_ == 0) {
+            // reviving a tombstone - the node never left the tree
+            cur_node->cnt_ = 1;
+            size_ += 1;
+            dead_ -= 1;
+        } else if (IsMultiSet) {
+            cur_node->cnt_ += 1;
+            size_ += 1;
+        } else {
+            return; // duplicate in a set: nothing changed
+        }
+        RenewAggregatesUpwards(cur_node);
+    }
+
+    // Re-derives the cnt_-weighted aggregates along the ancestor chain after
+    // a multiplicity change that moved no links; no-op for trees that track
+    // no subtree info.
+    void RenewAggregatesUpwards(std::shared_ptr<Node> node) {
+        if constexpr (Impl::kMaintainsSubtreeInfo) {
+            while (node) {
+                Self().RenewNodesHeight(node);
+                node = OwningPtr(node->parent_);
+            }
+        }
+    }
+
+    // owning handle of an in-tree node reached through a raw parent_ link:
+    // its parent's child slot, or root_; null stays null
+    std::shared_ptr<Node> OwningPtr(Node* node) const {
+        if (!node) {
+            return nullptr;
+        }
+        Node* parent = node->parent_;
+        if (!parent) {
+            return root_;
+        }
+        return parent->left_.get() == node ? parent->left_ : parent->right_;
+    }
+
+    // copies a key contributes to an in-order dump: cnt_ for a multiset,
+    // one for a set, zero for a tombstone either way
+    static size_t LiveCopies(const std::shared_ptr<Node>& node) {
+        return IsMultiSet ? node->cnt_ : (node->cnt_ != 0 ? 1 : 0);
+    }
+
+    // the vptr and the two reference counters of a co-allocated control block
+    static constexpr size_t kControlBlockBytes = 2 * sizeof(void*);
+
+    static size_t CountNodes(const std::shared_ptr<Node>& node) {
+        return node ? 1 + CountNodes(node->left_) + CountNodes(node->right_) : 0;
+    }
+
+    // in-order dump; multiset keys are repeated cnt_ times
+    static void CollectInOrder(const std::shared_ptr<Node>& node, std::vector<T>& out) {
+        if (!node) {
+            return;
+        }
+        CollectInOrder(node->left_, out);
+        for (size_t i = 0; i < LiveCopies(node); ++i) {
+            out.push_back(node->value_);
+        }
+        CollectInOrder(node->right_, out);
+    }
+
+    // collapse an already sorted range into (value, multiplicity) pairs;
+    // duplicates accumulate into cnt_ when IsMultiSet and are dropped otherwise
+    template<typename InputIt>
+    std::vector<std::pair<T, size_t>> PackSorted(InputIt first, InputIt last) const {
+        std::vector<std::pair<T, size_t>> packed;
+        for (; first != last; ++first) {
+            if (!packed.empty() && Equal(packed.back().first, *first)) {
+                if (IsMultiSet) {
+                    packed.back().second += 1;
+                }
+            } else {
+                packed.push_back({*first, 1});
+            }
+        }
+        return packed;
+    }
+    // element count of a packed range: multiplicities add up for a multiset
+    static size_t PackedTotal(const std::vector<std::pair<T, size_t>>& packed) {
+        size_t total = 0;
+        for (const auto& entry : packed) {
+            total += entry.second;
+        }
+        return total;
+    }
+
+    std::shared_ptr<Node> BuildRange(const std::vector<std::pair<T, size_t>>& values, size_t begin, size_t end) {
+        if (begin >= end) {
+            return nullptr;
+        }
+        size_t mid = begin + (end - begin) / 2;
+        auto node = Self().CreateNode(values[mid].first);
+        node->cnt_ = values[mid].second;
+        node->left_ = BuildRange(values, begin, mid);
+        node->right_ = BuildRange(values, mid + 1, end);
+        if (node->left_) node->left_->parent_ = node.get();
+        if (node->right_) node->right_->parent_ = node.get();
+        Self().RenewNodesHeight(node);
+        return node;
+    }
+
+    // below this many nodes a fork costs more than the build itself
+    static constexpr size_t kParallelBuildCutoff = 1 << 14;
+
+    std::shared_ptr<Node> BuildRangeParallel(const std::vector<std::pair<T, size_t>>& values,
+                                             size_t begin, size_t end, size_t threads) {
+        if (threads <= 1 || end - begin < kParallelBuildCutoff) {
+            return BuildRange(values, begin, end);
+        }
+        size_t mid = begin + (end - begin) / 2;
+        auto node = Self().CreateNode(values[mid].first);
+        node->cnt_ = values[mid].second;
+        auto left_ready = std::async(std::launch::async, [&] {
+            return BuildRangeParallel(values, begin, mid, threads / 2);
+        });
+        node->right_ = BuildRangeParallel(values, mid + 1, end, threads - threads / 2);
+        node->left_ = left_ready.get();
+        if (node->left_) node->left_->parent_ = node.get();
+        if (node->right_) node->right_->parent_ = node.get();
+        Self().RenewNodesHeight(node);
+        return node;
+    }
+
+    // in-order walk of one subtree; multiset keys repeat cnt_ times
+    template<typename Visitor>
+    static void VisitInOrder(const std::shared_ptr<Node>& node, Visitor& visitor) {
+        if (!node) {
+            return;
+        }
+        VisitInOrder(node->left_, visitor);
+        for (size_t i = 0; i < LiveCopies(node); ++i) {
+            visitor(node->value_);
+        }
+        VisitInOrder(node->right_, visitor);
+    }
+
+    // how much work a subtree holds: exact when nodes track size_, the AVL
+    // height as a stand-in otherwise, 1 for plain nodes (degrades to BFS order)
+    static size_t PartWeight(const std::shared_ptr<Node>& node) {
+        if constexpr (requires { node->size_; }) {
+            return node->size_;
+        } else if constexpr (requires { node->height_; }) {
+            return node->height_;
+        } else {
+            return (node->left_ || node->right_) ? 2 : 1;
+        }
+    }
+
+    // Iterative point lookup over raw pointers: one comparator call per level
+    // (lower-bound style, equality checked once at the bottom), no shared_ptr
+    // refcount traffic, and both children prefetched while the current key is
+    // being compared. Serves Exsist, optionally through the hot-key cache.
+    template<typename K>
+    const Node* FindNode(const K& value) const {
+        if (const Node* hit = CacheLookup(value)) {
+            return hit;
+        }
+        const Node* cur = root_.get();
+        const Node* candidate = nullptr;
+        while (cur) {
+            __builtin_prefetch(cur->left_.get());
+            __builtin_prefetch(cur->right_.get());
+            if (Less(cur->value_, value)) {
+                cur = cur->right_.get();
+            } else {
+                candidate = cur;
+                cur = cur->left_.get();
+            }
+        }
+        if (candidate && !Less(value, candidate->value_) && candidate->cnt_ != 0) {
+            CacheStore(value, candidate);
+            return candidate;
+        }
+        return nullptr;
+    }
+
+    // Same descent for callers that need an owning handle (Find, Erase):
+    // walks pointers-to-shared_ptr, so the only refcount bump is the final
+    // copy of the result.
+    template<typename K>
+    std::shared_ptr<Node> FindNodeShared(const K& value) const {
+        const std::shared_ptr<Node>* cur = &root_;
+        const std::shared_ptr<Node>* candidate = nullptr;
+        while (*cur) {
+            __builtin_prefetch(cur->get()->left_.get());
+            __builtin_prefetch(cur->get()->right_.get());
+            if (Less((*cur)->value_, value)) {
+                cur = &(*cur)->right_;
+            } else {
+                candidate = cur;
+                cur = &(*cur)->left_;
+            }
+        }
+        if (candidate && !Less(value, (*candidate)->value_) && (*candidate)->cnt_ != 0) {
+            return *candidate;
+        }
+        return nullptr;
+    }
+
+    static constexpr bool kHashableKey = requires(const T& v) { std::hash<T>{}(v); };
+
+    struct THotEntry {
+        const Node* node_ = nullptr;
+        uint64_t epoch_ = 0;
+    };
+
+    template<typename K>
+    const Node* CacheLookup(const K& value) const {
+        if constexpr (std::is_same_v<K, T> && kHashableKey) {
+            if (!hot_cache_.empty()) {
+                const auto& entry = hot_cache_[std::hash<T>{}(value) & (hot_cache_.size() - 1)];
+                if (entry.epoch_ == epoch_ && entry.node_ && entry.node_->cnt_ != 0 &&
+                    Equal(entry.node_->value_, value)) {
+                    return entry.node_;
+                }
+            }
+        }
+        return nullptr;
+    }
+    template<typename K>
+    void CacheStore(const K& value, const Node* node) const {
+        if constexpr (std::is_same_v<K, T> && kHashableKey) {
+            if (!hot_cache_.empty()) {
+                hot_cache_[std::hash<T>{}(value) & (hot_cache_.size() - 1)] = {node, epoch_};
+            }
+        }
+    }
+    // cached pointers may dangle after this; stale entries fail the epoch check
+    void InvalidateHotCache() {
+        epoch_ += 1;
+    }
+
+    std::shared_ptr<Node> CreateFakeNodeWithLeftSon(std::shared_ptr<Node> node) const {
+        auto new_node = std::make_shared<Node>(root_->value_);
+        new_node->left_ = node;
+        return new_node;
+    }
+
+    std::string HelpOutput(std::shared_ptr<Node> node) const {
+        auto parent_value = node->parent_ ? std::to_string(node->parent_->value_) : "none";
+        return parent_value;
+    }
+
+    std::ostream& Print(std::ostream& os) const {
+        DumpStats(os);
+        return DumpLevels(os);
+    }
+
+  public:
+    template <bool IsConst>
+    class BaseIterator {
+      public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = std::conditional_t<IsConst, const T, T>;
+        using difference_type = int64_t;
+        using pointer = value_type*;
+        using reference = value_type&;
+
+        BaseIterator(std::shared_ptr<Node> node) : pin_(std::move(node)), node_ptr(pin_.get()) {}
+        BaseIterator(std::shared_ptr<Node> node, size_t rep) : pin_(std::move(node)), node_ptr(pin_.get()), rep_(rep) {}
+        BaseIterator(std::shared_ptr<Node> pin, const Node* node, size_t rep)
+            : pin_(std::move(pin)), node_ptr(node), rep_(rep) {}
+
+        reference operator*() const { return node_ptr->value_; }
+        pointer operator->() { return &(node_ptr->value_); }
+
+        // Префиксные; a multiset key is visited cnt_ times before stepping on
+        BaseIterator& operator++() {
+            if (IsMultiSet && node_ptr && rep_ + 1 < node_ptr->cnt_) {
+                rep_ += 1;
+                return *this;
+            }
+            rep_ = 0;
+            do {
+                node_ptr = SuccessorNode(node_ptr);
+            } while (node_ptr && node_ptr->cnt_ == 0); // skip tombstones
+            return *this;
+        }
+        BaseIterator& operator--() {
+            if (IsMultiSet && rep_ > 0) {
+                rep_ -= 1;
+                return *this;
+            }
+            do {
+                node_ptr = PredecessorNode(node_ptr);
+            } while (node_ptr && node_ptr->cnt_ == 0);
+            rep_ = (IsMultiSet && node_ptr) ? node_ptr->cnt_ - 1 : 0;
+            return *this;
+        }
+
+        // Постфиксные
+        BaseIterator operator++(int) {
+            BaseIterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+        BaseIterator operator--(int) {
+            BaseIterator tmp = *this;
+            --(*this);
+            return tmp;
+        }
+
+        bool IsValid() const {
+            return (bool)node_ptr;
+        }
+        friend bool operator==(const BaseIterator& a, const BaseIterator& b) {
+            return a.node_ptr == b.node_ptr && a.rep_ == b.rep_;
+        }
+        friend bool operator!=(const BaseIterator& a, const BaseIterator& b) { return !(a == b); }
+        friend bool operator<(const BaseIterator& a, const BaseIterator& b) { return *a.node_ptr < *b.node_ptr; }
+        friend bool operator>(const BaseIterator& a, const BaseIterator& b) { return *a.node_ptr > *b.node_ptr; }
+        friend bool operator<=(const BaseIterator& a, const BaseIterator& b) { return *a.node_ptr <= *b.node_ptr; }
+        friend bool operator>=(const BaseIterator& a, const BaseIterator& b) { return *a.node_ptr >= *b.node_ptr; }
+
+      protected:
+        // pin_ keeps the anchor alive (Begin's min, Find's hit, RBegin's fake
+        // head node); stepping moves only the raw node_ptr and does no
+        // refcounting, so like any container iterator this one is valid only
+        // while the tree itself is alive and unmutated
+        std::shared_ptr<Node> pin_;
+        const Node* node_ptr = nullptr;
+        size_t rep_ = 0; // which copy of a multiset key we are on
+    };
+
+    // Fast full-scan alternative to BaseIterator: keeps the ancestor path on
+    // an explicit stack of raw pointers, so a step is amortized O(1) pointer
+    // chasing with zero weak_ptr::lock (i.e. atomic) traffic. The cursor pins
+    // the root for its lifetime; the tree must not be mutated while scanning.
+    class InOrderCursor {
+      public:
+        explicit InOrderCursor(const TSearchTreeBase& tree) : root_pin_(tree.root_) {
+            stack_.reserve(tree.Self().SubtreeHeight(tree.root_) + 1);
+            PushLeftSpine(root_pin_.get());
+            SkipDead();
+        }
+
+        bool IsValid() const {
+            return !stack_.empty();
+        }
+        const T& operator*() const {
+            return stack_.back()->value_;
+        }
+        const T* operator->() const {
+            return &stack_.back()->value_;
+        }
+        InOrderCursor& operator++() {
+            const Node* node = stack_.back();
+            if (IsMultiSet && rep_ + 1 < node->cnt_) {
+                rep_ += 1;
+                return *this;
+            }
+            rep_ = 0;
+            stack_.pop_back();
+            PushLeftSpine(node->right_.get());
+            SkipDead();
+            return *this;
+        }
+
+      private:
+        void SkipDead() {
+            while (!stack_.empty() && stack_.back()->cnt_ == 0) {
+                const Node* node = stack_.back();
+                stack_.pop_back();
+                PushLeftSpine(node->right_.get());
+            }
+        }
+
+        void PushLeftSpine(const Node* node) {
+            while (node) {
+                stack_.push_back(node);
+                node = node->left_.get();
+            }
+        }
+
+        std::shared_ptr<Node> root_pin_;
+        std::vector<const Node*> stack_;
+        size_t rep_ = 0;
+    };
+
+    InOrderCursor Cursor() const {
+        return InOrderCursor(*this);
+    }
+
+    using Iterator = BaseIterator<true>;
+    // using Iterator = BaseIterator<true> - | usually, but we cant modify nodes in SearchTree
+    using ConstIterator = BaseIterator<true>;
+    using ReverseIterator = std::reverse_iterator<Iterator>;
+    using ConstReverseIterator = std::reverse_iterator<ConstIterator>;
+
+    Iterator Begin() {
+        Iterator it(min_);
+        if (min_ && min_->cnt_ == 0) {
+            ++it; // the stepping itself skips tombstones
+        }
+        return it;
+    }
+    Iterator End() {
+        return Iterator(nullptr);
+    }
+    ConstIterator Begin() const {
+        ConstIterator it(min_);
+        if (min_ && min_->cnt_ == 0) {
+            ++it;
+        }
+        return it;
+    }
+    ConstIterator End() const {
+        return ConstIterator(nullptr);
+    }
+    Iterator begin() {
+        return Begin();
+    }
+    Iterator end() {
+        return End();
+    }
+    ConstIterator begin() const {
+        return Begin();
+    }
+    ConstIterator end() const {
+        return End();
+    }
+
+    ConstIterator CBegin() {
+        ConstIterator it(min_);
+        if (min_ && min_->cnt_ == 0) {
+            ++it;
+        }
+        return it;
+    }
+    ConstIterator CEnd() {
+        return ConstIterator(nullptr);
+    }
+
+    ReverseIterator RBegin() {
+        return ReverseIterator(CreateFakeNodeWithLeftSon(max_));
+    }
+    ReverseIterator REnd() {
+        return ReverseIterator(Begin());
+    }
+    ConstReverseIterator RBegin() const {
+        return ConstReverseIterator(CreateFakeNodeWithLeftSon(max_));
+    }
+    ConstReverseIterator REnd() const {
+        return ConstReverseIterator(Begin());
+    }
+    ConstReverseIterator CRBegin() {
+        return ConstReverseIterator(CreateFakeNodeWithLeftSon(max_));
+    }
+    ConstReverseIterator CREnd() {
+        return ConstReverseIterator(CBegin());
+    }
+
+
+    Iterator Find(const T& value) const {
+        return Iterator(FindNodeShared(value));
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator Find(const K& value) const {
+        return Iterator(FindNodeShared(value));
+    }
+
+    Iterator Next(const T& value) const {
+        return Iterator(root_, NextNode(value), 0);
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator Next(const K& value) const {
+        return Iterator(root_, NextNode(value), 0);
+    }
+    Iterator Prev(const T& value) const {
+        return Iterator(root_, PrevNode(value), 0);
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator Prev(const K& value) const {
+        return Iterator(root_, PrevNode(value), 0);
+    }
+
+    // first key >= value; End() if there is none
+    Iterator LowerBound(const T& value) const {
+        return Iterator(root_, LowerBoundNode(value), 0);
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator LowerBound(const K& value) const {
+        return Iterator(root_, LowerBoundNode(value), 0);
+    }
+    // first key > value; same single descent as Next
+    Iterator UpperBound(const T& value) const {
+        return Iterator(root_, NextNode(value), 0);
+    }
+    template<typename K, typename C = Compare, typename = typename C::is_transparent>
+    Iterator UpperBound(const K& value) const {
+        return Iterator(root_, NextNode(value), 0);
+    }
+
+    // Visits every key in [lo, hi] in order, O(log n + m): both boundary
+    // descents are walked once instead of re-descending from the root per
+    // element the way chained Next calls do.
+    template<typename Visitor>
+    void RangeIterate(const T& lo, const T& hi, Visitor visitor) const {
+        RangeIterateRecursive(root_, lo, hi, visitor);
+    }
+
+  protected:
+    template<typename Visitor>
+    void RangeIterateRecursive(const std::shared_ptr<Node>& node, const T& lo, const T& hi, Visitor& visitor) const {
+        if (!node) {
+            return;
+        }
+        if (Less(lo, node->value_)) {
+            RangeIterateRecursive(node->left_, lo, hi, visitor);
+        }
+        if (node->cnt_ != 0 && !Less(node->value_, lo) && !Less(hi, node->value_)) {
+            visitor(node->value_);
+        }
+        if (Less(node->value_, hi)) {
+            RangeIterateRecursive(node->right_, lo, hi, visitor);
+        }
+    }
+
+    // Shared descents behind Next/Prev/LowerBound; K is whatever the
+    // comparator can order against T.
+    template<typename K>
+    const Node* NextNode(const K& value) const {
+        const Node* next = nullptr;
+        const Node* cur_node = root_.get();
+        while (cur_node) {
+            if (Less(value, cur_node->value_)) {
+                next = cur_node;
+                cur_node = cur_node->left_.get();
+            } else { // cur_node->value_ <= value
+                cur_node = cur_node->right_.get();
+            }
+        }
+        while (next && next->cnt_ == 0) {
+            next = SuccessorNode(next);
+        }
+        return next;
+    }
+    template<typename K>
+    const Node* PrevNode(const K& value) const {
+        const Node* prev = nullptr;
+        const Node* cur_node = root_.get();
+        while (cur_node) {
+            if (Less(cur_node->value_, value)) {
+                prev = cur_node;
+                cur_node = cur_node->right_.get();
+            } else { // cur_node->value_ >= value
+                cur_node = cur_node->left_.get();
+            }
+        }
+        while (prev && prev->cnt_ == 0) {
+            prev = PredecessorNode(prev);
+        }
+        return prev;
+    }
+    template<typename K>
+    const Node* LowerBoundNode(const K& value) const {
+        const Node* best = nullptr;
+        const Node* cur_node = root_.get();
+        while (cur_node) {
+            if (Less(cur_node->value_, value)) {
+                cur_node = cur_node->right_.get();
+            } else { // cur_node->value_ >= value
+                best = cur_node;
+                cur_node = cur_node->left_.get();
+            }
+        }
+        while (best && best->cnt_ == 0) {
+            best = SuccessorNode(best);
+        }
+        return best;
+    }
+
+    // pure pointer chasing - no refcount traffic per step
+    static const Node* SuccessorNode(const Node* node) {
+        if (node->right_) {
+            return FindMin(node->right_.get());
+        }
+        while (IsRightSon(node)) {
+            node = node->parent_;
+        }
+        return node->parent_;
+    }
+    static const Node* PredecessorNode(const Node* node) {
+        if (node->left_) {
+            return FindMax(node->left_.get());
+        }
+        while (IsLeftSon(node)) {
+            node = node->parent_;
+        }
+        return node->parent_;
+    }
+
+    static std::shared_ptr<Node> FindMin(std::shared_ptr<Node> node) {
+        while (node && node->left_) {
+            node = node->left_;
+        }
+        return node;
+    }
+    static std::shared_ptr<Node> FindMax(std::shared_ptr<Node> node) {
+        while (node && node->right_) {
+            node = node->right_;
+        }
+        return node;
+    }
+    static const Node* FindMin(const Node* node) {
+        while (node && node->left_) {
+            node = node->left_.get();
+        }
+        return node;
+    }
+    static const Node* FindMax(const Node* node) {
+        while (node && node->right_) {
+            node = node->right_.get();
+        }
+        return node;
+    }
+
+    std::shared_ptr<Node> root_ = nullptr;
+    size_t size_ = 0;
+    [[no_unique_address]] TTreeStats stats_;
+    // hot-key cache (see EnableHotKeyCache); empty means disabled
+    mutable std::vector<THotEntry> hot_cache_;
+    uint64_t epoch_ = 1;
+    // tombstoned (cnt_ == 0) nodes still in the structure; cleared by Compact
+    size_t dead_ = 0;
+    // cached extrema, kept up to date by Insert/Erase/BuildFromSorted so that
+    // Begin/Min/Max never pay a root-to-leaf descent
+    std::shared_ptr<Node> min_ = nullptr;
+    std::shared_ptr<Node> max_ = nullptr;
+};
+
+
+template<typename T, bool IsMultiSet, typename Compare = std::less<T>>
+class TSearchTree : public TSearchTreeBase<T, IsMultiSet, TPlainNode<T>, TSearchTree<T, IsMultiSet, Compare>, Compare> {
+    friend class TSearchTreeBase<T, IsMultiSet, TPlainNode<T>, TSearchTree<T, IsMultiSet, Compare>, Compare>;
+};
+
+
+// AVL balancing over any node that carries height_. Impl is still the
+// concrete tree: it supplies CreateNode and RenewNodesHeight, so the same
+// rotation code maintains plain heights and height+size nodes alike.
+template<typename T, bool IsMultiSet, typename NodeT, typename Impl, typename Compare = std::less<T>>
+class TAvlTreeBase : public TSearchTreeBase<T, IsMultiSet, NodeT, Impl, Compare> {
+  protected:
+    using Base = TSearchTreeBase<T, IsMultiSet, NodeT, Impl, Compare>;
+    using Node = NodeT;
+    using Base::Self;
+    using Base::Less;
+
+  public:
+    // Merges other into this tree in O(log n) by height-based joining; every
+    // key of other must be strictly greater than every key here. other is
+    // left empty.
+    void JoinWith(Impl& other) {
+        static_assert(Impl::kTransferableNodes,
+                      "JoinWith adopts the donor's nodes, but this tree variant keeps its nodes "
+                      "in a tree-private arena that is freed when the donor is destroyed");
+        // node-count bookkeeping below assumes no tombstones on either side
+        this->Compact();
+        other.Compact();
+        if (!other.root_) {
+            return;
+        }
+        other.InvalidateHotCache();
+        if (!this->root_) {
+            std::swap(this->root_, other.root_);
+            std::swap(this->size_, other.size_);
+            std::swap(this->min_, other.min_);
+            std::swap(this->max_, other.max_);
+            return;
+        }
+        // splice out our max as the middle key (it has no right child)
+        auto mid = this->FindMax(this->root_);
+        Node* parent = mid->parent_;
+        auto child = mid->left_;
+        if (child) {
+            child->parent_ = parent;
+        }
+        if (parent) {
+            parent->right_ = child;
+            this->RebalanceUpwards(parent);
+        } else {
+            this->root_ = child;
+        }
+        mid->left_ = nullptr;
+        mid->right_ = nullptr;
+        mid->parent_ = nullptr;
+
+        this->root_ = JoinNodes(this->root_, mid, other.root_);
+        this->root_->parent_ = nullptr;
+        this->size_ += other.size_;
+        this->max_ = other.max_;
+        other.root_ = nullptr;
+        other.size_ = 0;
+        other.min_ = nullptr;
+        other.max_ = nullptr;
+    }
+
+    // Carves out all keys > key and returns them as a new tree; this keeps
+    // keys <= key. Only the O(log n) nodes along the split path are relinked.
+    Impl SplitOff(const T& key) {
+        static_assert(Impl::kTransferableNodes,
+                      "SplitOff hands nodes over to a new tree, but this tree variant keeps its "
+                      "nodes in a tree-private arena owned by the source tree");
+        this->Compact(); // the size accounting below counts nodes
+        this->InvalidateHotCache();
+        Impl result;
+        auto [left, right] = SplitNodes(this->root_, key);
+        this->root_ = left;
+        if (left) left->parent_ = nullptr;
+        result.root_ = right;
+        if (right) right->parent_ = nullptr;
+        auto right_count = SubtreeCount(right);
+        result.size_ = right_count;
+        this->size_ -= right_count;
+        // the overall max migrates with the right part; both boundary nodes
+        // along the cut need a fresh descent
+        result.max_ = right ? this->max_ : nullptr;
+        result.min_ = this->FindMin(right);
+        this->min_ = left ? this->min_ : nullptr;
+        this->max_ = this->FindMax(left);
+        return result;
+    }
+
+  protected:
+    std::shared_ptr<Node> JoinNodes(std::shared_ptr<Node> left, std::shared_ptr<Node> mid, std::shared_ptr<Node> right) {
+        if ((int64_t)NodeHeight(left) > (int64_t)NodeHeight(right) + 1) {
+            left->right_ = JoinNodes(left->right_, mid, right);
+            left->right_->parent_ = left.get();
+            return Self().Balance(left);
+        }
+        if ((int64_t)NodeHeight(right) > (int64_t)NodeHeight(left) + 1) {
+            right->left_ = JoinNodes(left, mid, right->left_);
+            right->left_->parent_ = right.get();
+            return Self().Balance(right);
+        }
+        mid->left_ = left;
+        mid->right_ = right;
+        if (left) left->parent_ = mid.get();
+        if (right) right->parent_ = mid.get();
+        return Self().Balance(mid);
+    }
+
+    std::pair<std::shared_ptr<Node>, std::shared_ptr<Node>> SplitNodes(std::shared_ptr<Node> node, const T& key) {
+        if (!node) {
+            return {nullptr, nullptr};
+        }
+        auto left_son = node->left_;
+        auto right_son = node->right_;
+        node->left_ = nullptr;
+        node->right_ = nullptr;
+        node->parent_ = nullptr;
+        if (left_son) left_son->parent_ = nullptr;
+        if (right_son) right_son->parent_ = nullptr;
+
+        if (!Less(key, node->value_)) {
+            auto [l, r] = SplitNodes(right_son, key);
+            return {JoinNodes(left_son, node, l), r};
+        } else {
+            auto [l, r] = SplitNodes(left_son, key);
+            return {l, JoinNodes(r, node, right_son)};
+        }
+    }
+
+    // Elements under a node: size_-tracking nodes answer in O(1); otherwise
+    // count the moved part, weighting multiset keys by cnt_.
+    static size_t SubtreeCount(const std::shared_ptr<Node>& node) {
+        if (!node) {
+            return 0;
+        }
+        if constexpr (requires { node->size_; }) {
+            return node->size_;
+        } else {
+            return Base::LiveCopies(node) + SubtreeCount(node->left_) + SubtreeCount(node->right_);
+        }
+    }
+
+    std::shared_ptr<Node> Balance(std::shared_ptr<Node> node) {
+        if (!node)
+            return nullptr;
+        Self().RenewNodesHeight(node);
+
+        auto node_height = HeightDiff(node);
+
+        if (node_height < -1) {
+            return LeftRotation(node);
+        } else if (node_height > 1) {
+            return  RightRotation(node);
+        } else {
+            return node;
+        }
+    }
+    template<typename... Args>
+    std::shared_ptr<Node> CreateNode(Args&&... args) {
+        return std::make_shared<Node>(std::forward<Args>(args)...);
+    }
+    size_t SubtreeHeight(const std::shared_ptr<Node>& node) const {
+        return NodeHeight(node);
+    }
+
+    static size_t NodeHeight(const std::shared_ptr<Node>& node) {
+        return (node ? node->height_ : 0);
+    }
+    // int64_t arithmetic before the subtraction: heights are size_t and the
+    // difference is frequently negative.
+    static int64_t HeightDiff(const std::shared_ptr<Node>& node) {
+        return node ? (int64_t)NodeHeight(node->left_) - (int64_t)NodeHeight(node->right_) : 0;
+    }
+
+    std::string HelpOutput(std::shared_ptr<Node> node) const {
+        return node ? std::to_string(node->height_) : "none";
+    }
+
+    bool ValidateNode(const std::shared_ptr<Node>& node, size_t left_height, size_t right_height) const {
+        int64_t diff = (int64_t)left_height - (int64_t)right_height;
+        return node->height_ == std::max(left_height, right_height) + 1 && -1 <= diff && diff <= 1;
+    }
+
+    void RenewNodesHeight(const std::shared_ptr<Node>& node) {
+        if (node) {
+            node->height_ = std::max(NodeHeight(node->right_), NodeHeight(node->left_)) + 1;
+        }
+    }
+
+    std::shared_ptr<Node> RotateRight(std::shared_ptr<Node> node) {
+        this->stats_.OnRotation();
+        std::shared_ptr<Node> son = node->left_;
+        std::shared_ptr<Node> T2 = son->right_;
+
+        son->right_ = node;
+        node->left_ = T2;
+
+        node->parent_ = son.get();
+        if (T2) T2->parent_ = node.get();
+
+        Self().RenewNodesHeight(node);
+        Self().RenewNodesHeight(son);
+
+        return son;
+    }
+
+    std::shared_ptr<Node> RotateLeft(std::shared_ptr<Node> node) {
+        this->stats_.OnRotation();
+        std::shared_ptr<Node> son = node->right_;
+        std::shared_ptr<Node> T2 = son->left_;
+
+        son->left_ = node;
+        node->right_ = T2;
+
+        node->parent_ = son.get();
+        if (T2) T2->parent_ = node.get();
+
+        Self().RenewNodesHeight(node);
+        Self().RenewNodesHeight(son);
+
+        return son;
+    }
+
+    std::shared_ptr<Node> RightRotation(std::shared_ptr<Node> node) {
+        if (HeightDiff(node->left_) >= 0) {
+            return RotateRight(node);
+        } else {
+            node->left_ = RotateLeft(node->left_);
+            if (node->left_) node->left_->parent_ = node.get();
+            return RotateRight(node);
+        }
+    }
+    std::shared_ptr<Node> LeftRotation(std::shared_ptr<Node> node) {
+        if (HeightDiff(node->right_) <= 0) {
+            return RotateLeft(node);
+        } else {
+            node->right_ = RotateRight(node->right_);
+            if (node->right_) node->right_->parent_ = node.get();
+            return RotateLeft(node);
+        }
+    }
+};
+
+
+template<typename T, bool IsMultiSet, typename Compare = std::less<T>>
+class TAvlTree : public TAvlTreeBase<T, IsMultiSet, TAvlNode<T>, TAvlTree<T, IsMultiSet, Compare>, Compare> {
+    friend class TSearchTreeBase<T, IsMultiSet, TAvlNode<T>, TAvlTree<T, IsMultiSet, Compare>, Compare>;
+    friend class TAvlTreeBase<T, IsMultiSet, TAvlNode<T>, TAvlTree<T, IsMultiSet, Compare>, Compare>;
+};
+
+
+// Same balancing as TAvlTree, but nodes (together with their shared_ptr
+// control blocks, thanks to allocate_shared) live in contiguous slabs of the
+// tree's own arena. No per-node malloc on Insert, and the whole tree is freed
+// in a handful of munmap-sized chunks on destruction. Iterators must not
+// outlive the tree.
+template<typename T, bool IsMultiSet, typename Compare = std::less<T>>
+class TArenaAvlTree : public TAvlTreeBase<T, IsMultiSet, TAvlNode<T>, TArenaAvlTree<T, IsMultiSet, Compare>, Compare> {
+    friend class TSearchTreeBase<T, IsMultiSet, TAvlNode<T>, TArenaAvlTree<T, IsMultiSet, Compare>, Compare>;
+    friend class TAvlTreeBase<T, IsMultiSet, TAvlNode<T>, TArenaAvlTree<T, IsMultiSet, Compare>, Compare>;
+
+  private:
+    using Node = TAvlNode<T>;
+
+  public:
+    TArenaAvlTree() {}
+    explicit TArenaAvlTree(size_t block_size) : arena_(block_size) {}
+
+    ~TArenaAvlTree() {
+        // the node handles live in the base and would otherwise be destroyed
+        // after arena_; release them while their slabs are still alive
+        this->min_ = nullptr;
+        this->max_ = nullptr;
+        this->root_ = nullptr;
+    }
+
+  protected:
+    // the slab arena is a single bump pointer - no concurrent CreateNode
+    static constexpr bool kThreadSafeCreateNode = false;
+    // nodes and their control blocks live in arena_ and die with this tree,
+    // so they must never be relinked into another tree
+    static constexpr bool kTransferableNodes = false;
+
+    template<typename... Args>
+    std::shared_ptr<Node> CreateNode(Args&&... args) {
+        return std::allocate_shared<Node>(TArenaAllocator<Node>(&arena_), std::forward<Args>(args)...);
+    }
+
+  private:
+    TSlabArena arena_;
+};
+
+
+template<typename T, bool IsMultiSet, typename Compare = std::less<T>>
+class TAvlTreeWithSize : public TAvlTreeBase<T, IsMultiSet, TAvlNodeWithSize<T>, TAvlTreeWithSize<T, IsMultiSet, Compare>, Compare> {
+    friend class TSearchTreeBase<T, IsMultiSet, TAvlNodeWithSize<T>, TAvlTreeWithSize<T, IsMultiSet, Compare>, Compare>;
+    friend class TAvlTreeBase<T, IsMultiSet, TAvlNodeWithSize<T>, TAvlTreeWithSize<T, IsMultiSet, Compare>, Compare>;
+
+  private:
+    using Node = TAvlNodeWithSize<T>;
+
+  protected:
+    // size_ changes on every ancestor up to the root, so the rebalance walk
+    // may not stop at the first height-stable subtree.
+    static constexpr bool kMaintainsSubtreeInfo = true;
+
+    static size_t NodeSize(const std::shared_ptr<Node>& node) {
+        return (node ? node->size_ : 0);
+    }
+    void RenewNodesHeight(const std::shared_ptr<Node>& node) {
+        if (node) {
+            node->height_ = std::max(this->NodeHeight(node->right_), this->NodeHeight(node->left_)) + 1;
+            // element-weighted: every copy counts, tombstones (cnt_ 0) none
+            node->size_ = NodeSize(node->right_) + NodeSize(node->left_) + node->cnt_;
+        }
+    }
+
+    std::string HelpOutput(std::shared_ptr<Node> node) const {
+        return node ? std::to_string(node->size_) : "none";
+    }
+
+    bool ValidateNode(const std::shared_ptr<Node>& node, size_t left_height, size_t right_height) const {
+        int64_t diff = (int64_t)left_height - (int64_t)right_height;
+        return node->height_ == std::max(left_height, right_height) + 1
+            && -1 <= diff && diff <= 1
+            && node->size_ == NodeSize(node->left_) + NodeSize(node->right_) + node->cnt_;
+    }
+
+  public:
+    // Iterator that uses the subtree sizes for O(log n) arithmetic: += climbs
+    // to the root to learn its own rank, then re-selects the target rank
+    // downward. Stepping the end iterator is not supported (it holds no node).
+    template <bool IsConst>
+    class BaseIterator : public TAvlTreeBase<T, IsMultiSet, Node, TAvlTreeWithSize, Compare>::template BaseIterator<IsConst> {
+      private:
+        using ParentClass = typename TAvlTreeBase<T, IsMultiSet, Node, TAvlTreeWithSize, Compare>::template BaseIterator<IsConst>;
+
+      public:
+        using difference_type = typename ParentClass::difference_type;
+
+        BaseIterator(std::shared_ptr<Node> node) : ParentClass(std::move(node)) {}
+        BaseIterator(std::shared_ptr<Node> node, size_t rep) : ParentClass(std::move(node), rep) {}
+        BaseIterator(std::shared_ptr<Node> pin, const Node* node, size_t rep)
+            : ParentClass(std::move(pin), node, rep) {}
+        BaseIterator(const ParentClass& other) : ParentClass(other) {}
+
+        BaseIterator& operator+=(difference_type n) {
+            const Node* node = this->node_ptr;
+            difference_type rank = NodeSize(node->left_) + (difference_type)this->rep_;
+            while (const Node* parent = node->parent_) {
+                if (parent->right_.get() == node) {
+                    rank += NodeSize(parent->left_) + parent->cnt_;
+                }
+                node = parent;
+            }
+            // node is the root now; select rank + n from it
+            this->node_ptr = SelectRank(node, rank + n, this->rep_);
+            return *this;
+        }
+        BaseIterator& operator-=(difference_type n) {
+            return *this += -n;
+        }
+
+        friend BaseIterator operator+(const BaseIterator& it, difference_type n) {
+            auto tmp(it);
+            tmp += n;
+            return tmp;
+        }
+        friend BaseIterator operator+(difference_type n, const BaseIterator& it) {
+            return it + n;
+        }
+        friend BaseIterator operator-(const BaseIterator& it, difference_type n) {
+            return it + (-n);
+        }
+        friend difference_type operator-(const BaseIterator& a, const BaseIterator& b) {
+            return a.Rank() - b.Rank();
+        }
+
+      private:
+        difference_type Rank() const {
+            const Node* node = this->node_ptr;
+            difference_type rank = NodeSize(node->left_) + (difference_type)this->rep_;
+            while (const Node* parent = node->parent_) {
+                if (parent->right_.get() == node) {
+                    rank += NodeSize(parent->left_) + parent->cnt_;
+                }
+                node = parent;
+            }
+            return rank;
+        }
+    };
+
+    using Iterator = BaseIterator<true>;
+    // using Iterator = BaseIterator<true> - | usually, but we cant modify nodes in SearchTree
+    using ConstIterator = BaseIterator<true>;
+
+    Iterator Begin() const {
+        Iterator it(this->min_);
+        if (this->min_ && this->min_->cnt_ == 0) {
+            ++it;
+        }
+        return it;
+    }
+    Iterator End() const {
+        return Iterator(nullptr);
+    }
+
+    // k-th smallest element, 0-based and cnt_-weighted; End() when k >= Size()
+    Iterator Kth(size_t k) const {
+        size_t rep = 0;
+        const Node* node = SelectRank(this->root_.get(), (int64_t)k, rep);
+        return Iterator(this->root_, node, rep);
+    }
+    // number of elements in [lo, hi], two rank descents - O(log n)
+    size_t CountRange(const T& lo, const T& hi) const {
+        if (this->Less(hi, lo)) {
+            return 0;
+        }
+        return RankOf(hi) + this->Count(hi) - RankOf(lo);
+    }
+    // number of elements strictly less than value (whether or not present);
+    // every copy of a smaller multiset key counts
+    size_t RankOf(const T& value) const {
+        size_t rank = 0;
+        auto node = this->root_;
+        while (node) {
+            if (this->Less(value, node->value_)) {
+                node = node->left_;
+            } else if (this->Equal(node->value_, value)) {
+                return rank + NodeSize(node->left_);
+            } else { // node->value_ < value
+                rank += NodeSize(node->left_) + node->cnt_;
+                node = node->right_;
+            }
+        }
+        return rank;
+    }
+
+  private:
+    // rep comes back as the copy offset inside the selected key
+    static const Node* SelectRank(const Node* node, int64_t rank, size_t& rep) {
+        rep = 0;
+        if (!node || rank < 0 || rank >= (int64_t)node->size_) {
+            return nullptr;
+        }
+        while (node) {
+            auto left_size = (int64_t)NodeSize(node->left_);
+            if (rank < left_size) {
+                node = node->left_.get();
+            } else if (rank < left_size + (int64_t)node->cnt_) {
+                rep = (size_t)(rank - left_size);
+                return node;
+            } else {
+                rank -= left_size + node->cnt_;
+                node = node->right_.get();
+            }
+        }
+        return nullptr;
+    }
+};
+
+
+// Canonical monoids for TAvlTreeAugmented. A monoid supplies the aggregate
+// type, the identity, an associative Combine, and Measure - the contribution
+// of one key with its multiplicity (cnt_ 0, a tombstone, must measure as the
+// identity so lazy erases drop out of every aggregate immediately).
+template<typename T>
+struct TSumMonoid {
+    using ValueType = T;
+    static ValueType Identity() { return T{}; }
+    static ValueType Combine(const ValueType& a, const ValueType& b) { return a + b; }
+    static ValueType Measure(const T& value, size_t cnt) { return value * (T)cnt; }
+};
+
+template<typename T>
+struct TMinMonoid {
+    using ValueType = T;
+    static ValueType Identity() { return std::numeric_limits<T>::max(); }
+    static ValueType Combine(const ValueType& a, const ValueType& b) { return std::min(a, b); }
+    static ValueType Measure(const T& value, size_t cnt) { return cnt != 0 ? value : Identity(); }
+};
+
+template<typename T>
+struct TMaxMonoid {
+    using ValueType = T;
+    static ValueType Identity() { return std::numeric_limits<T>::lowest(); }
+    static ValueType Combine(const ValueType& a, const ValueType& b) { return std::max(a, b); }
+    static ValueType Measure(const T& value, size_t cnt) { return cnt != 0 ? value : Identity(); }
+};
+
+
+// Generalization of the TAvlTreeWithSize pattern: instead of a hard-coded
+// subtree size_, every node carries the Monoid aggregate of its subtree,
+// maintained in RenewNodesHeight alongside height_ - i.e. on the exact same
+// inserts, erases and rotations. QueryRange folds the monoid over a key
+// range in O(log n): the two boundary descents consume whole-subtree
+// aggregates instead of visiting elements, which replaces a separate
+// Fenwick-tree sidecar for range sums.
+template<typename T, typename Monoid, bool IsMultiSet = false, typename Compare = std::less<T>>
+class TAvlTreeAugmented : public TAvlTreeBase<T, IsMultiSet, TAvlNodeAugmented<T, typename Monoid::ValueType>, TAvlTreeAugmented<T, Monoid, IsMultiSet, Compare>, Compare> {
+    friend class TSearchTreeBase<T, IsMultiSet, TAvlNodeAugmented<T, typename Monoid::ValueType>, TAvlTreeAugmented<T, Monoid, IsMultiSet, Compare>, Compare>;
+    friend class TAvlTreeBase<T, IsMultiSet, TAvlNodeAugmented<T, typename Monoid::ValueType>, TAvlTreeAugmented<T, Monoid, IsMultiSet, Compare>, Compare>;
+
+  private:
+    using Node = TAvlNodeAugmented<T, typename Monoid::ValueType>;
+    using AggValue = typename Monoid::ValueType;
+
+  public:
+    // the whole tree's aggregate, O(1)
+    AggValue Aggregate() const {
+        return AggOf(this->root_);
+    }
+
+    // Monoid fold over all keys in [lo, hi], cnt_-weighted, O(log n): descend
+    // to the subtree where the range splits, then walk each boundary once,
+    // absorbing every fully-covered subtree by its stored aggregate.
+    AggValue QueryRange(const T& lo, const T& hi) const {
+        auto result = Monoid::Identity();
+        if (this->Less(hi, lo)) {
+            return result;
+        }
+        const Node* node = this->root_.get();
+        while (node) {
+            if (this->Less(node->value_, lo)) {
+                node = node->right_.get();
+            } else if (this->Less(hi, node->value_)) {
+                node = node->left_.get();
+            } else {
+                break; // lo <= node->value_ <= hi: the range splits here
+            }
+        }
+        if (!node) {
+            return result;
+        }
+        result = Monoid::Measure(node->value_, node->cnt_);
+        // left boundary: everything in node->left_ that is >= lo
+        for (const Node* cur = node->left_.get(); cur;) {
+            if (this->Less(cur->value_, lo)) {
+                cur = cur->right_.get();
+            } else {
+                result = Monoid::Combine(Monoid::Measure(cur->value_, cur->cnt_),
+                                         Monoid::Combine(AggOf(cur->right_), result));
+                cur = cur->left_.get();
+            }
+        }
+        // right boundary: everything in node->right_ that is <= hi
+        for (const Node* cur = node->right_.get(); cur;) {
+            if (this->Less(hi, cur->value_)) {
+                cur = cur->left_.get();
+            } else {
+                result = Monoid::Combine(result,
+                                         Monoid::Combine(AggOf(cur->left_),
+                                                         Monoid::Measure(cur->value_, cur->cnt_)));
+                cur = cur->right_.get();
+            }
+        }
+        return result;
+    }
+
+  protected:
+    // the aggregate changes on every ancestor up to the root, so the
+    // rebalance walk may not stop at the first height-stable subtree
+    static constexpr bool kMaintainsSubtreeInfo = true;
+
+    static AggValue AggOf(const std::shared_ptr<Node>& node) {
+        return node ? node->agg_ : Monoid::Identity();
+    }
+
+    // a fresh leaf is attached without any renew pass over it, so its
+    // aggregate has to be right from birth - the default A{} is not
+    template<typename... Args>
+    std::shared_ptr<Node> CreateNode(Args&&... args) {
+        auto node = std::make_shared<Node>(std::forward<Args>(args)...);
+        node->agg_ = Monoid::Measure(node->value_, node->cnt_);
+        return node;
+    }
+
+    void RenewNodesHeight(const std::shared_ptr<Node>& node) {
+        if (node) {
+            node->height_ = std::max(this->NodeHeight(node->right_), this->NodeHeight(node->left_)) + 1;
+            node->agg_ = Monoid::Combine(AggOf(node->left_),
+                                         Monoid::Combine(Monoid::Measure(node->value_, node->cnt_),
+                                                         AggOf(node->right_)));
+        }
+    }
+
+    bool ValidateNode(const std::shared_ptr<Node>& node, size_t left_height, size_t right_height) const {
+        int64_t diff = (int64_t)left_height - (int64_t)right_height;
+        if (node->height_ != std::max(left_height, right_height) + 1 || diff < -1 || 1 < diff) {
+            return false;
+        }
+        if constexpr (requires(const AggValue& a) { a == a; }) {
+            return node->agg_ == Monoid::Combine(AggOf(node->left_),
+                                                 Monoid::Combine(Monoid::Measure(node->value_, node->cnt_),
+                                                                 AggOf(node->right_)));
+        } else {
+            return true;
+        }
+    }
+};
+
+
+// Compact storage engine: keys and topology live in parallel vector slabs
+// (struct-of-arrays) and links are 32-bit indices, so a node costs
+// sizeof(T) + 12 bytes instead of two shared_ptr plus a weak_ptr with their
+// control blocks, and neighbouring nodes share cache lines. There is no
+// rebalancing - the intended use is read-mostly trees built balanced through
+// BuildFromSorted with occasional point updates on top.
+template<typename T>
+class TCompactSearchTree {
+  public:
+    using IndexType = uint32_t;
+    static constexpr IndexType kNullIndex = std::numeric_limits<IndexType>::max();
+
+    void Reserve(size_t n) {
+        values_.reserve(n);
+        left_.reserve(n);
+        right_.reserve(n);
+        parent_.reserve(n);
+    }
+
+    void Insert(const T& value) {
+        if (root_ == kNullIndex) {
+            root_ = AllocNode(value, kNullIndex);
+            return;
+        }
+        IndexType cur = root_;
+        while (true) {
+            if (values_[cur] == value) {
+                return;
+            }
+            bool go_left = values_[cur] > value;
+            IndexType son = go_left ? left_[cur] : right_[cur];
+            if (son == kNullIndex) {
+                // AllocNode may grow the slabs, so link via indices only
+                IndexType fresh = AllocNode(value, cur);
+                (go_left ? left_[cur] : right_[cur]) = fresh;
+                return;
+            }
+            cur = son;
+        }
+    }
+
+    void Erase(const T& value) {
+        IndexType node = FindIndex(value);
+        if (node == kNullIndex) {
+            return;
+        }
+        if (left_[node] != kNullIndex && right_[node] != kNullIndex) {
+            // relink the in-order successor into node's position
+            IndexType succ = MinIndex(right_[node]);
+            if (parent_[succ] != node) {
+                Relink(parent_[succ], succ, right_[succ]);
+                right_[succ] = right_[node];
+                parent_[right_[succ]] = succ;
+            }
+            left_[succ] = left_[node];
+            parent_[left_[succ]] = succ;
+            Relink(parent_[node], node, succ);
+        } else {
+            IndexType child = (left_[node] != kNullIndex) ? left_[node] : right_[node];
+            Relink(parent_[node], node, child);
+        }
+        FreeNode(node);
+    }
+
+    bool Exsist(const T& value) const {
+        return FindIndex(value) != kNullIndex;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+    // O(n) balanced construction from a sorted unique range, replacing the
+    // current contents; the slabs are filled densely with no holes.
+    template<typename InputIt>
+    void BuildFromSorted(InputIt first, InputIt last) {
+        Clear();
+        std::vector<T> values(first, last);
+        Reserve(values.size());
+        root_ = BuildRange(values, 0, values.size(), kNullIndex);
+    }
+    void BuildFromSorted(const std::vector<T>& values) {
+        BuildFromSorted(values.begin(), values.end());
+    }
+
+    void Clear() {
+        values_.clear();
+        left_.clear();
+        right_.clear();
+        parent_.clear();
+        free_.clear();
+        root_ = kNullIndex;
+        size_ = 0;
+    }
+
+    class ConstIterator {
+      public:
+        ConstIterator(const TCompactSearchTree* tree, IndexType idx) : tree_(tree), idx_(idx) {}
+
+        const T& operator*() const { return tree_->values_[idx_]; }
+        const T* operator->() const { return &tree_->values_[idx_]; }
+
+        ConstIterator& operator++() {
+            idx_ = tree_->SuccessorIndex(idx_);
+            return *this;
+        }
+        ConstIterator operator++(int) {
+            ConstIterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool IsValid() const {
+            return idx_ != kNullIndex;
+        }
+        friend bool operator==(const ConstIterator& a, const ConstIterator& b) { return a.idx_ == b.idx_; }
+        friend bool operator!=(const ConstIterator& a, const ConstIterator& b) { return a.idx_ != b.idx_; }
+
+      private:
+        const TCompactSearchTree* tree_;
+        IndexType idx_;
+    };
+    using Iterator = ConstIterator;
+
+    ConstIterator Begin() const {
+        return ConstIterator(this, root_ == kNullIndex ? kNullIndex : MinIndex(root_));
+    }
+    ConstIterator End() const {
+        return ConstIterator(this, kNullIndex);
+    }
+    ConstIterator begin() const { return Begin(); }
+    ConstIterator end() const { return End(); }
+
+    ConstIterator Find(const T& value) const {
+        return ConstIterator(this, FindIndex(value));
+    }
+    ConstIterator Next(const T& value) const {
+        IndexType next = kNullIndex;
+        IndexType cur = root_;
+        while (cur != kNullIndex) {
+            if (values_[cur] > value) {
+                next = cur;
+                cur = left_[cur];
+            } else {
+                cur = right_[cur];
+            }
+        }
+        return ConstIterator(this, next);
+    }
+    ConstIterator Prev(const T& value) const {
+        IndexType prev = kNullIndex;
+        IndexType cur = root_;
+        while (cur != kNullIndex) {
+            if (values_[cur] < value) {
+                prev = cur;
+                cur = right_[cur];
+            } else {
+                cur = left_[cur];
+            }
+        }
+        return ConstIterator(this, prev);
+    }
+
+  private:
+    IndexType AllocNode(const T& value, IndexType parent) {
+        IndexType idx;
+        if (!free_.empty()) {
+            idx = free_.back();
+            free_.pop_back();
+            values_[idx] = value;
+        } else {
+            idx = (IndexType)values_.size();
+            values_.push_back(value);
+            left_.push_back(kNullIndex);
+            right_.push_back(kNullIndex);
+            parent_.push_back(kNullIndex);
+        }
+        left_[idx] = kNullIndex;
+        right_[idx] = kNullIndex;
+        parent_[idx] = parent;
+        size_ += 1;
+        return idx;
+    }
+    void FreeNode(IndexType idx) {
+        free_.push_back(idx);
+        size_ -= 1;
+    }
+
+    // replaces old_son with new_son under parent (or at the root)
+    void Relink(IndexType parent, IndexType old_son, IndexType new_son) {
+        if (parent == kNullIndex) {
+            root_ = new_son;
+        } else {
+            (left_[parent] == old_son ? left_[parent] : right_[parent]) = new_son;
+        }
+        if (new_son != kNullIndex) {
+            parent_[new_son] = parent;
+        }
+    }
+
+    IndexType FindIndex(const T& value) const {
+        IndexType cur = root_;
+        while (cur != kNullIndex) {
+            if (values_[cur] == value) {
+                return cur;
+            }
+            cur = (values_[cur] > value) ? left_[cur] : right_[cur];
+        }
+        return kNullIndex;
+    }
+    IndexType MinIndex(IndexType idx) const {
+        while (left_[idx] != kNullIndex) {
+            idx = left_[idx];
+        }
+        return idx;
+    }
+    IndexType SuccessorIndex(IndexType idx) const {
+        if (right_[idx] != kNullIndex) {
+            return MinIndex(right_[idx]);
+        }
+        while (parent_[idx] != kNullIndex && right_[parent_[idx]] == idx) {
+            idx = parent_[idx];
+        }
+        return parent_[idx];
+    }
+
+    IndexType BuildRange(const std::vector<T>& values, size_t begin, size_t end, IndexType parent) {
+        if (begin >= end) {
+            return kNullIndex;
+        }
+        size_t mid = begin + (end - begin) / 2;
+        IndexType idx = AllocNode(values[mid], parent);
+        left_[idx] = BuildRange(values, begin, mid, idx);
+        right_[idx] = BuildRange(values, mid + 1, end, idx);
+        return idx;
+    }
+
+    std::vector<T> values_;
+    std::vector<IndexType> left_;
+    std::vector<IndexType> right_;
+    std::vector<IndexType> parent_;
+    std::vector<IndexType> free_;
+    IndexType root_ = kNullIndex;
+    size_t size_ = 0;
+};
+
+
+// Leaf-array storage engine: keys live in small sorted arrays of up to 32
+// entries ("leaves"), ordered by their first key, with a binary search over
+// the leaf heads followed by a linear scan inside one leaf - for int64 keys
+// the scan touches 2-3 cache lines and vectorizes, where a pointer tree
+// would take that many cache misses per level. A full leaf splits in half;
+// an emptied leaf is dropped. Compared to a node per key (~56 bytes of
+// pointers around 8 bytes of payload) this stores ~9 bytes per key, the
+// B-tree trade without the B-tree: point updates shift at most one leaf.
+template<typename T>
+class TLeafArrayTree {
+  public:
+    static constexpr size_t kLeafCapacity = 32;
+
+    void Insert(const T& value) {
+        if (leaves_.empty()) {
+            leaves_.push_back(std::make_unique<TLeaf>());
+            leaves_[0]->keys_[0] = value;
+            leaves_[0]->count_ = 1;
+            size_ += 1;
+            return;
+        }
+        size_t idx = LeafIndexFor(value);
+        TLeaf* leaf = leaves_[idx].get();
+        size_t pos = leaf->LowerBound(value);
+        if (pos < leaf->count_ && leaf->keys_[pos] == value) {
+            return; // set semantics, like the compact engine
+        }
+        if (leaf->count_ == kLeafCapacity) {
+            // split in half; the new right leaf keeps the upper keys
+            auto right = std::make_unique<TLeaf>();
+            right->count_ = kLeafCapacity / 2;
+            leaf->count_ = kLeafCapacity - right->count_;
+            std::copy(leaf->keys_ + leaf->count_, leaf->keys_ + kLeafCapacity, right->keys_);
+            leaves_.insert(leaves_.begin() + idx + 1, std::move(right));
+            if (pos > leaf->count_ || (pos == leaf->count_ && !(value < leaves_[idx + 1]->keys_[0]))) {
+                idx += 1;
+                leaf = leaves_[idx].get();
+                pos = leaf->LowerBound(value);
+            } else {
+                leaf = leaves_[idx].get();
+            }
+        }
+        std::copy_backward(leaf->keys_ + pos, leaf->keys_ + leaf->count_, leaf->keys_ + leaf->count_ + 1);
+        leaf->keys_[pos] = value;
+        leaf->count_ += 1;
+        size_ += 1;
+    }
+
+    void Erase(const T& value) {
+        if (leaves_.empty()) {
+            return;
+        }
+        size_t idx = LeafIndexFor(value);
+        TLeaf* leaf = leaves_[idx].get();
+        size_t pos = leaf->LowerBound(value);
+        if (pos == leaf->count_ || !(leaf->keys_[pos] == value)) {
+            return;
+        }
+        std::copy(leaf->keys_ + pos + 1, leaf->keys_ + leaf->count_, leaf->keys_ + pos);
+        leaf->count_ -= 1;
+        if (leaf->count_ == 0) {
+            leaves_.erase(leaves_.begin() + idx);
+        }
+        size_ -= 1;
+    }
+
+    bool Exsist(const T& value) const {
+        if (leaves_.empty()) {
+            return false;
+        }
+        const TLeaf* leaf = leaves_[LeafIndexFor(value)].get();
+        size_t pos = leaf->LowerBound(value);
+        return pos < leaf->count_ && leaf->keys_[pos] == value;
+    }
+
+    // replaces the contents with half-full leaves, so a bulk-loaded tree has
+    // headroom before the first splits
+    void BuildFromSorted(const std::vector<T>& values) {
+        leaves_.clear();
+        size_t fill = kLeafCapacity / 2;
+        for (size_t begin = 0; begin < values.size(); begin += fill) {
+            auto leaf = std::make_unique<TLeaf>();
+            leaf->count_ = std::min(fill, values.size() - begin);
+            std::copy(values.begin() + begin, values.begin() + begin + leaf->count_, leaf->keys_);
+            leaves_.push_back(std::move(leaf));
+        }
+        size_ = values.size();
+    }
+
+    void Clear() {
+        leaves_.clear();
+        size_ = 0;
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+    bool Empty() const {
+        return size_ == 0;
+    }
+    size_t LeafCount() const {
+        return leaves_.size();
+    }
+
+    class ConstIterator {
+      public:
+        ConstIterator(const TLeafArrayTree* tree, size_t leaf, size_t pos)
+            : tree_(tree), leaf_(leaf), pos_(pos) {}
+
+        const T& operator*() const { return tree_->leaves_[leaf_]->keys_[pos_]; }
+        const T* operator->() const { return &tree_->leaves_[leaf_]->keys_[pos_]; }
+
+        ConstIterator& operator++() {
+            if (++pos_ >= tree_->leaves_[leaf_]->count_) {
+                leaf_ += 1;
+                pos_ = 0;
+            }
+            return *this;
+        }
+        ConstIterator operator++(int) {
+            ConstIterator tmp = *this;
+            ++(*this);
+            return tmp;
+        }
+
+        bool IsValid() const {
+            return leaf_ < tree_->leaves_.size();
+        }
+        friend bool operator==(const ConstIterator& a, const ConstIterator& b) {
+            return a.leaf_ == b.leaf_ && a.pos_ == b.pos_;
+        }
+        friend bool operator!=(const ConstIterator& a, const ConstIterator& b) {
+            return !(a == b);
+        }
+
+      private:
+        const TLeafArrayTree* tree_;
+        size_t leaf_;
+        size_t pos_;
+    };
+    using Iterator = ConstIterator;
+
+    ConstIterator Begin() const {
+        return ConstIterator(this, 0, 0);
+    }
+    ConstIterator End() const {
+        return ConstIterator(this, leaves_.size(), 0);
+    }
+    ConstIterator begin() const { return Begin(); }
+    ConstIterator end() const { return End(); }
+
+    ConstIterator Find(const T& value) const {
+        if (!leaves_.empty()) {
+            size_t idx = LeafIndexFor(value);
+            size_t pos = leaves_[idx]->LowerBound(value);
+            if (pos < leaves_[idx]->count_ && leaves_[idx]->keys_[pos] == value) {
+                return ConstIterator(this, idx, pos);
+            }
+        }
+        return End();
+    }
+    ConstIterator Next(const T& value) const {
+        if (leaves_.empty()) {
+            return End();
+        }
+        size_t idx = LeafIndexFor(value);
+        const TLeaf* leaf = leaves_[idx].get();
+        for (size_t pos = 0; pos < leaf->count_; ++pos) {
+            if (value < leaf->keys_[pos]) {
+                return ConstIterator(this, idx, pos);
+            }
+        }
+        // everything in this leaf is <= value; the answer heads the next leaf
+        return ConstIterator(this, idx + 1, 0);
+    }
+    ConstIterator Prev(const T& value) const {
+        if (leaves_.empty()) {
+            return End();
+        }
+        size_t idx = LeafIndexFor(value);
+        const TLeaf* leaf = leaves_[idx].get();
+        for (size_t pos = leaf->count_; pos-- > 0;) {
+            if (leaf->keys_[pos] < value) {
+                return ConstIterator(this, idx, pos);
+            }
+        }
+        // everything here is >= value; the answer tails the previous leaf
+        if (idx == 0) {
+            return End();
+        }
+        return ConstIterator(this, idx - 1, leaves_[idx - 1]->count_ - 1);
+    }
+
+  private:
+    struct TLeaf {
+        T keys_[kLeafCapacity];
+        size_t count_ = 0;
+
+        // linear scan: at most two or three cache lines for int64 keys, and
+        // the loop is branch-predictable and auto-vectorizes
+        size_t LowerBound(const T& value) const {
+            size_t pos = 0;
+            while (pos < count_ && keys_[pos] < value) {
+                pos += 1;
+            }
+            return pos;
+        }
+    };
+
+    // the leaf that may contain value: the last one whose first key is <= value
+    size_t LeafIndexFor(const T& value) const {
+        auto it = std::upper_bound(leaves_.begin(), leaves_.end(), value,
+                                   [](const T& v, const std::unique_ptr<TLeaf>& leaf) {
+                                       return v < leaf->keys_[0];
+                                   });
+        return it == leaves_.begin() ? 0 : (it - leaves_.begin()) - 1;
+    }
+
+    // unique_ptr keeps leaves at stable addresses while leaf inserts shift
+    // only 8-byte handles
+    std::vector<std::unique_ptr<TLeaf>> leaves_;
+    size_t size_ = 0;
+};
+
+// Immutable-node AVL machinery shared by TCowAvlTree and
+// TPersistentAvlTree: path-copying Insert/Erase clone only the O(log n)
+// nodes along the modified spine and share every untouched subtree, and the
+// read loops walk raw pointers over const nodes. Nodes carry no parent links
+// (a shared subtree has many parents). Stateless - both owners keep their
+// own roots.
+template<typename T>
+class TPathCopyAvlOps {
+  protected:
+    struct Node {
+        T value_;
+        std::shared_ptr<const Node> left_;
+        std::shared_ptr<const Node> right_;
+        size_t height_ = 1;
+
+        Node(const T& value) : value_(value) {}
+        Node(const Node& other) = default;
+    };
+    using NodePtr = std::shared_ptr<const Node>;
+
+    static bool ExsistIn(const Node* cur, const T& value) {
+        while (cur) {
+            if (cur->value_ == value) return true;
+            cur = (cur->value_ > value) ? cur->left_.get() : cur->right_.get();
+        }
+        return false;
+    }
+    static const T* NextIn(const Node* cur, const T& value) {
+        const T* next = nullptr;
+        while (cur) {
+            if (cur->value_ > value) {
+                next = &cur->value_;
+                cur = cur->left_.get();
+            } else {
+                cur = cur->right_.get();
+            }
+        }
+        return next;
+    }
+    static const T* PrevIn(const Node* cur, const T& value) {
+        const T* prev = nullptr;
+        while (cur) {
+            if (cur->value_ < value) {
+                prev = &cur->value_;
+                cur = cur->right_.get();
+            } else {
+                cur = cur->left_.get();
+            }
+        }
+        return prev;
+    }
+    template<typename Visitor>
+    static void VisitInOrder(const Node* node, Visitor& visitor) {
+        if (!node) return;
+        VisitInOrder(node->left_.get(), visitor);
+        visitor(node->value_);
+        VisitInOrder(node->right_.get(), visitor);
+    }
+
+    static std::shared_ptr<Node> Clone(const NodePtr& node) {
+        return std::make_shared<Node>(*node);
+    }
+    static size_t NodeHeight(const NodePtr& node) {
+        return node ? node->height_ : 0;
+    }
+    static void RenewHeight(Node* node) {
+        node->height_ = std::max(NodeHeight(node->left_), NodeHeight(node->right_)) + 1;
+    }
+
+    // the argument is always a private (already cloned) node; its sons stay
+    // shared and get cloned only when a rotation has to relink them
+    static std::shared_ptr<Node> RotateRight(std::shared_ptr<Node> node) {
+        auto son = Clone(node->left_);
+        node->left_ = son->right_;
+        RenewHeight(node.get());
+        son->right_ = std::move(node);
+        RenewHeight(son.get());
+        return son;
+    }
+    static std::shared_ptr<Node> RotateLeft(std::shared_ptr<Node> node) {
+        auto son = Clone(node->right_);
+        node->right_ = son->left_;
+        RenewHeight(node.get());
+        son->left_ = std::move(node);
+        RenewHeight(son.get());
+        return son;
+    }
+    static NodePtr BalanceNode(std::shared_ptr<Node> node) {
+        RenewHeight(node.get());
+        auto diff = (int64_t)NodeHeight(node->left_) - (int64_t)NodeHeight(node->right_);
+        if (diff > 1) {
+            if (NodeHeight(node->left_->left_) < NodeHeight(node->left_->right_)) {
+                node->left_ = RotateLeft(Clone(node->left_));
+            }
+            return RotateRight(std::move(node));
+        }
+        if (diff < -1) {
+            if (NodeHeight(node->right_->right_) < NodeHeight(node->right_->left_)) {
+                node->right_ = RotateRight(Clone(node->right_));
+            }
+            return RotateLeft(std::move(node));
+        }
+        return node;
+    }
+
+    static NodePtr InsertRecursive(const NodePtr& node, const T& value, bool& added) {
+        if (!node) {
+            added = true;
+            return std::make_shared<Node>(value);
+        }
+        if (node->value_ == value) {
+            added = false;
+            return node;
+        }
+        auto copy = Clone(node);
+        if (node->value_ > value) {
+            copy->left_ = InsertRecursive(node->left_, value, added);
+        } else {
+            copy->right_ = InsertRecursive(node->right_, value, added);
+        }
+        if (!added) {
+            return node; // nothing changed, keep the shared original
+        }
+        return BalanceNode(std::move(copy));
+    }
+
+    static NodePtr EraseRecursive(const NodePtr& node, const T& value, bool& removed) {
+        if (!node) {
+            removed = false;
+            return nullptr;
+        }
+        std::shared_ptr<Node> copy;
+        if (node->value_ > value) {
+            copy = Clone(node);
+            copy->left_ = EraseRecursive(node->left_, value, removed);
+        } else if (node->value_ < value) {
+            copy = Clone(node);
+            copy->right_ = EraseRecursive(node->right_, value, removed);
+        } else {
+            removed = true;
+            if (!node->left_) return node->right_;
+            if (!node->right_) return node->left_;
+            const Node* min_node = node->right_.get();
+            while (min_node->left_) {
+                min_node = min_node->left_.get();
+            }
+            copy = Clone(node);
+            copy->value_ = min_node->value_;
+            bool dummy = false;
+            copy->right_ = EraseRecursive(node->right_, min_node->value_, dummy);
+        }
+        if (!removed) {
+            return node;
+        }
+        return BalanceNode(std::move(copy));
+    }
+};
+
+// Copy-on-write AVL tree for the single-writer / many-readers pattern.
+// Insert/Erase clone only the O(log n) nodes along the modified path (all
+// other subtrees are shared), then publish the new root atomically, so a
+// reader that grabbed Snapshot() keeps traversing a consistent tree with no
+// lock at all - even while the writer keeps mutating. The stackless
+// iterators of the other trees are replaced by ForEach.
+template<typename T>
+class TCowAvlTree : protected TPathCopyAvlOps<T> {
+  protected:
+    using typename TPathCopyAvlOps<T>::Node;
+    using typename TPathCopyAvlOps<T>::NodePtr;
+    using TPathCopyAvlOps<T>::InsertRecursive;
+    using TPathCopyAvlOps<T>::EraseRecursive;
+
+  public:
+    // Immutable view of the tree at the moment Snapshot() was called.
+    class TSnapshot {
+      public:
+        TSnapshot(NodePtr root, size_t size) : root_(std::move(root)), size_(size) {}
+
+        size_t Size() const {
+            return size_;
+        }
+        bool Exsist(const T& value) const {
+            return TCowAvlTree::ExsistIn(root_.get(), value);
+        }
+        // smallest key > value, or nullptr; the pointer stays valid as long
+        // as this snapshot is alive
+        const T* Next(const T& value) const {
+            return TCowAvlTree::NextIn(root_.get(), value);
+        }
+        const T* Prev(const T& value) const {
+            return TCowAvlTree::PrevIn(root_.get(), value);
+        }
+        template<typename Visitor>
+        void ForEach(Visitor visitor) const {
+            TCowAvlTree::VisitInOrder(root_.get(), visitor);
+        }
+
+      private:
+        NodePtr root_;
+        size_t size_;
+    };
+
+    // Root and size are published together as one immutable state object, so
+    // a snapshot can never observe a root from one version and the size of
+    // another.
+    TSnapshot Snapshot() const {
+        auto state = state_.load(std::memory_order_acquire);
+        if (!state) {
+            return TSnapshot(nullptr, 0);
+        }
+        return TSnapshot(state->root_, state->size_);
+    }
+
+    // Writer side; not safe to call from several threads at once.
+    void Insert(const T& value) {
+        auto state = state_.load(std::memory_order_relaxed);
+        bool added = false;
+        auto new_root = InsertRecursive(state ? state->root_ : nullptr, value, added);
+        if (added) {
+            Publish(std::move(new_root), (state ? state->size_ : 0) + 1);
+        }
+    }
+    void Erase(const T& value) {
+        auto state = state_.load(std::memory_order_relaxed);
+        bool removed = false;
+        auto new_root = EraseRecursive(state ? state->root_ : nullptr, value, removed);
+        if (removed) {
+            Publish(std::move(new_root), state->size_ - 1);
+        }
+    }
+
+    bool Exsist(const T& value) const {
+        return Snapshot().Exsist(value);
+    }
+    size_t Size() const {
+        auto state = state_.load(std::memory_order_acquire);
+        return state ? state->size_ : 0;
+    }
+    bool Empty() const {
+        return Size() == 0;
+    }
+
+  protected:
+    struct TState {
+        NodePtr root_;
+        size_t size_;
+    };
+
+    void Publish(NodePtr root, size_t size) {
+        state_.store(std::make_shared<const TState>(TState{std::move(root), size}), std::memory_order_release);
+    }
+
+    std::atomic<std::shared_ptr<const TState>> state_{nullptr};
+};
+
+
+// Persistent (fully immutable) AVL tree: a cheap value-semantic version
+// handle over the same path-copying machinery TCowAvlTree uses. Insert/Erase
+// do not mutate this version - they return a NEW handle that shares every
+// untouched subtree with the old one, so a modification costs O(log n) fresh
+// nodes and a "snapshot" is simply keeping the handle around (copying one is
+// two words). Any number of versions stay readable forever; nodes are freed
+// by shared_ptr once the last version referencing them is gone. Unlike
+// TCowAvlTree there is no writer state to race on - handles are plain values.
+template<typename T>
+class TPersistentAvlTree : protected TPathCopyAvlOps<T> {
+  protected:
+    using typename TPathCopyAvlOps<T>::Node;
+    using typename TPathCopyAvlOps<T>::NodePtr;
+
+  public:
+    TPersistentAvlTree() = default;
+
+    // Both return the resulting version and leave *this untouched; inserting
+    // a present key or erasing a missing one returns a handle sharing the
+    // whole tree with this one.
+    [[nodiscard]] TPersistentAvlTree Insert(const T& value) const {
+        bool added = false;
+        auto root = TPathCopyAvlOps<T>::InsertRecursive(root_, value, added);
+        return added ? TPersistentAvlTree(std::move(root), size_ + 1) : *this;
+    }
+    [[nodiscard]] TPersistentAvlTree Erase(const T& value) const {
+        bool removed = false;
+        auto root = TPathCopyAvlOps<T>::EraseRecursive(root_, value, removed);
+        return removed ? TPersistentAvlTree(std::move(root), size_ - 1) : *this;
+    }
+
+    bool Exsist(const T& value) const {
+        return TPathCopyAvlOps<T>::ExsistIn(root_.get(), value);
+    }
+    // smallest key > value, or nullptr; the pointer stays valid as long as
+    // any version containing the node is alive
+    const T* Next(const T& value) const {
+        return TPathCopyAvlOps<T>::NextIn(root_.get(), value);
+    }
+    const T* Prev(const T& value) const {
+        return TPathCopyAvlOps<T>::PrevIn(root_.get(), value);
+    }
+    template<typename Visitor>
+    void ForEach(Visitor visitor) const {
+        TPathCopyAvlOps<T>::VisitInOrder(root_.get(), visitor);
+    }
+
+    size_t Size() const {
+        return size_;
+    }
+    bool Empty() const {
+        return size_ == 0;
+    }
+
+  protected:
+    TPersistentAvlTree(NodePtr root, size_t size) : root_(std::move(root)), size_(size) {}
+
+    NodePtr root_;
+    size_t size_ = 0;
+};
+
+
+// Range-partitioned concurrent wrapper: the key space is cut by the sorted
+// splitters given at construction into splitters.size() + 1 independent
+// TAvlTree shards, each behind its own mutex, so writers touching different
+// key ranges never contend. Shard i holds keys in [splitters[i-1],
+// splitters[i]); every point operation locks exactly one shard. Next/Prev
+// answer from the key's own shard and otherwise take the min/max of the
+// following/preceding shard - two shards when neighbours are non-empty,
+// skipping empty ones. They return the value by copy (an iterator would
+// outlive its shard's lock).
+template<typename T, bool IsMultiSet, typename Compare = std::less<T>>
+class TShardedAvlTree {
+  public:
+    explicit TShardedAvlTree(std::vector<T> splitters)
+        : splitters_(std::move(splitters))
+        , shards_(splitters_.size() + 1) {
+    }
+
+    void Insert(const T& value) {
+        auto& shard = ShardFor(value);
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        shard.tree_.Insert(value);
+    }
+    void Erase(const T& value) {
+        auto& shard = ShardFor(value);
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        shard.tree_.Erase(value);
+    }
+    bool Exsist(const T& value) const {
+        const auto& shard = ShardFor(value);
+        std::lock_guard<std::mutex> lock(shard.mutex_);
+        return shard.tree_.Exsist(value);
+    }
+
+    // smallest key > value; empty optional if none
+    std::optional<T> Next(const T& value) const {
+        size_t index = ShardIndex(value);
+        {
+            std::lock_guard<std::mutex> lock(shards_[index].mutex_);
+            auto it = shards_[index].tree_.Next(value);
+            if (it.IsValid()) {
+                return *it;
+            }
+        }
+        for (size_t i = index + 1; i < shards_.size(); ++i) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex_);
+            if (!shards_[i].tree_.Empty()) {
+                return shards_[i].tree_.Min();
+            }
+        }
+        return std::nullopt;
+    }
+    // largest key < value; empty optional if none
+    std::optional<T> Prev(const T& value) const {
+        size_t index = ShardIndex(value);
+        {
+            std::lock_guard<std::mutex> lock(shards_[index].mutex_);
+            auto it = shards_[index].tree_.Prev(value);
+            if (it.IsValid()) {
+                return *it;
+            }
+        }
+        for (size_t i = index; i-- > 0;) {
+            std::lock_guard<std::mutex> lock(shards_[i].mutex_);
+            if (!shards_[i].tree_.Empty()) {
+                return shards_[i].tree_.Max();
+            }
+        }
+        return std::nullopt;
+    }
+
+    size_t Size() const {
+        size_t total = 0;
+        for (const auto& shard : shards_) {
+            std::lock_guard<std::mutex> lock(shard.mutex_);
+            total += shard.tree_.Size();
+        }
+        return total;
+    }
+    bool Empty() const {
+        return Size() == 0;
+    }
+    size_t ShardCount() const {
+        return shards_.size();
+    }
+
+  private:
+    struct TShard {
+        mutable std::mutex mutex_;
+        TAvlTree<T, IsMultiSet, Compare> tree_;
+    };
+
+    // first shard whose splitter is > value; keys equal to a splitter land in
+    // the shard to its right
+    size_t ShardIndex(const T& value) const {
+        return std::upper_bound(splitters_.begin(), splitters_.end(), value, comp_) - splitters_.begin();
+    }
+    TShard& ShardFor(const T& value) {
+        return shards_[ShardIndex(value)];
+    }
+    const TShard& ShardFor(const T& value) const {
+        return shards_[ShardIndex(value)];
+    }
+
+    [[no_unique_address]] Compare comp_;
+    std::vector<T> splitters_; // sorted; never changes after construction
+    std::vector<TShard> shards_;
+};
@@ -0,0 +1,528 @@
+// Randomized invariant stress: millions of mixed operations on every tree
+// variant, cross-checked against std::multiset / std::set, with Validate()
+// auditing the full structure at intervals. Exits non-zero on the first
+// divergence. Beyond the per-variant mixed-operation loop it covers
+// JoinWith/SplitOff, the order-statistics surface (Kth/RankOf/CountRange and
+// random-access iterator arithmetic), monoid QueryRange, serialization
+// round-trips with TFlatTreeView, the flat point engines (TCompactSearchTree,
+// TLeafArrayTree), concurrent TShardedAvlTree writers, TCowAvlTree snapshot
+// isolation and TPersistentAvlTree version freezing.
+//
+//   ./stress_test [iterations_per_variant]     (default 1'000'000)
+//
+// Also pins the regressions we have been bitten by before: erasing the last
+// element used to dereference a null root_, HeightDiff used to compute the
+// balance factor in unsigned arithmetic (so sorted insertions degraded into
+// a list without anyone noticing), and the flat-dump header once accepted a
+// forged count_ whose byte size wrapped around.
+#include "search_tree.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+
+namespace {
+
+int g_failures = 0;
+
+void Check(bool ok, const char* what) {
+    if (!ok) {
+        std::fprintf(stderr, "FAIL: %s\n", what);
+        g_failures += 1;
+    }
+}
+
+template<typename Tree, bool IsMultiSet>
+void StressVariant(const char* name, size_t iterations, uint64_t seed) {
+    Tree tree;
+    std::multiset<int64_t> ref;
+    std::mt19937_64 rng(seed);
+    // narrow key range so every operation kind hits existing keys often
+    const int64_t range = 1 + (int64_t)(rng() % 2000);
+
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t v = (int64_t)(rng() % range);
+        switch (rng() % 10) {
+            case 0: case 1: case 2: case 3:
+                tree.Insert(v);
+                if (IsMultiSet || ref.count(v) == 0) {
+                    ref.insert(v);
+                }
+                break;
+            case 4: case 5: {
+                tree.Erase(v);
+                auto it = ref.find(v);
+                if (it != ref.end()) {
+                    ref.erase(it);
+                }
+                break;
+            }
+            case 6:
+                tree.EraseAll(v);
+                ref.erase(v);
+                break;
+            case 7:
+                tree.EraseLazy(v);
+                ref.erase(v);
+                break;
+            case 8: {
+                auto next = tree.Next(v);
+                auto it = ref.upper_bound(v);
+                Check(next.IsValid() == (it != ref.end()), "Next validity");
+                if (next.IsValid() && it != ref.end()) {
+                    Check(*next == *it, "Next value");
+                }
+                break;
+            }
+            default: {
+                auto prev = tree.Prev(v);
+                auto it = ref.lower_bound(v);
+                Check(prev.IsValid() == (it != ref.begin()), "Prev validity");
+                if (prev.IsValid() && it != ref.begin()) {
+                    Check(*prev == *std::prev(it), "Prev value");
+                }
+            }
+        }
+        Check(tree.Size() == ref.size(), "Size");
+        Check(tree.Count(v) == (IsMultiSet ? ref.count(v) : (ref.count(v) ? 1 : 0)), "Count");
+
+        if (i % 10000 == 0) {
+            Check(tree.Validate(), "Validate");
+        }
+        if (i % 50000 == 0) {
+            tree.Compact();
+            Check(tree.Validate(), "Validate after Compact");
+        }
+    }
+
+    // final full sweep: contents must match element for element
+    tree.Compact();
+    Check(tree.Validate(), "final Validate");
+    auto rit = ref.begin();
+    for (auto it = tree.Begin(); it != tree.End(); ++it, ++rit) {
+        if (rit == ref.end() || *it != *rit) {
+            Check(false, "in-order contents");
+            break;
+        }
+    }
+    Check(rit == ref.end(), "in-order length");
+
+    std::printf("%-28s %8zu ops  final size %6zu  %s\n",
+                name, iterations, ref.size(), g_failures ? "FAIL" : "ok");
+}
+
+// JoinWith/SplitOff: two disjoint-range trees are merged, audited, then cut
+// back apart at a random key and both halves compared element for element
+// against the partitioned reference.
+template<typename Tree, bool IsMultiSet>
+void StressJoinSplit(const char* name, size_t rounds, uint64_t seed) {
+    std::mt19937_64 rng(seed);
+    for (size_t round = 0; round < rounds; ++round) {
+        const int64_t pivot = 1000;
+        Tree low, high;
+        std::multiset<int64_t> ref;
+        size_t n = 1 + rng() % 400;
+        for (size_t i = 0; i < n; ++i) {
+            int64_t lo_key = (int64_t)(rng() % pivot);
+            int64_t hi_key = pivot + (int64_t)(rng() % pivot);
+            low.Insert(lo_key);
+            high.Insert(hi_key);
+            if (IsMultiSet || ref.count(lo_key) == 0) ref.insert(lo_key);
+            if (IsMultiSet || ref.count(hi_key) == 0) ref.insert(hi_key);
+        }
+        low.JoinWith(high);
+        Check(high.Empty(), "JoinWith empties the donor");
+        Check(low.Size() == ref.size(), "size after JoinWith");
+        Check(low.Validate(), "Validate after JoinWith");
+
+        int64_t cut = (int64_t)(rng() % (2 * pivot));
+        Tree upper = low.SplitOff(cut);
+        Check(low.Validate() && upper.Validate(), "Validate after SplitOff");
+        size_t below = 0;
+        for (auto v : ref) below += (v <= cut) ? 1 : 0;
+        Check(low.Size() == below && upper.Size() == ref.size() - below, "SplitOff sizes");
+        auto rit = ref.begin();
+        for (auto it = low.Begin(); it != low.End(); ++it, ++rit) {
+            Check(rit != ref.end() && *it == *rit, "SplitOff left contents");
+        }
+        for (auto it = upper.Begin(); it != upper.End(); ++it, ++rit) {
+            Check(rit != ref.end() && *it == *rit, "SplitOff right contents");
+        }
+        Check(rit == ref.end(), "SplitOff total length");
+    }
+    std::printf("%-28s %8zu rounds  %s\n", name, rounds, g_failures ? "FAIL" : "ok");
+}
+
+// Kth/RankOf/CountRange and the random-access iterator arithmetic of
+// TAvlTreeWithSize against a plain sorted vector, duplicates included.
+void StressOrderStatistics(size_t iterations, uint64_t seed) {
+    TAvlTreeWithSize<int64_t, true> tree;
+    std::multiset<int64_t> ref;
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t v = (int64_t)(rng() % 200);
+        if (rng() % 3 != 0) {
+            tree.Insert(v);
+            ref.insert(v);
+        } else {
+            tree.Erase(v);
+            auto it = ref.find(v);
+            if (it != ref.end()) ref.erase(it);
+        }
+    }
+    std::vector<int64_t> sorted(ref.begin(), ref.end());
+    for (size_t k = 0; k < sorted.size(); k += 1 + k / 16) {
+        auto it = tree.Kth(k);
+        Check(it.IsValid() && *it == sorted[k], "Kth");
+    }
+    Check(!tree.Kth(sorted.size()).IsValid(), "Kth out of range");
+    for (int64_t v = 0; v < 200; v += 7) {
+        size_t below = std::lower_bound(sorted.begin(), sorted.end(), v) - sorted.begin();
+        Check(tree.RankOf(v) == below, "RankOf");
+        int64_t hi = v + (int64_t)(rng() % 60);
+        size_t want = std::upper_bound(sorted.begin(), sorted.end(), hi) -
+                      std::lower_bound(sorted.begin(), sorted.end(), v);
+        Check(tree.CountRange(v, hi) == want, "CountRange");
+    }
+    if (!sorted.empty()) {
+        auto it0 = tree.Kth(0);
+        for (size_t k = 0; k < sorted.size(); k += 1 + k / 8) {
+            auto it = it0 + (int64_t)k;
+            Check(*it == sorted[k], "iterator +");
+            Check((size_t)(it - it0) == k, "iterator difference");
+        }
+    }
+    std::printf("%-28s %8zu ops    final size %6zu  %s\n",
+                "order statistics", iterations, ref.size(), g_failures ? "FAIL" : "ok");
+}
+
+// monoid folds over random ranges against brute force
+void StressQueryRange(size_t iterations, uint64_t seed) {
+    TAvlTreeAugmented<int64_t, TSumMonoid<int64_t>, true> sum;
+    TAvlTreeAugmented<int64_t, TMinMonoid<int64_t>, true> mn;
+    std::multiset<int64_t> ref;
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t v = (int64_t)(rng() % 300) - 150;
+        switch (rng() % 6) {
+            case 0: case 1: case 2:
+                sum.Insert(v); mn.Insert(v); ref.insert(v);
+                break;
+            case 3: {
+                sum.Erase(v); mn.Erase(v);
+                auto it = ref.find(v);
+                if (it != ref.end()) ref.erase(it);
+                break;
+            }
+            case 4:
+                sum.EraseLazy(v); mn.EraseLazy(v); ref.erase(v);
+                break;
+            default: {
+                int64_t lo = (int64_t)(rng() % 340) - 170;
+                int64_t hi = lo + (int64_t)(rng() % 120);
+                int64_t want_sum = 0;
+                int64_t want_min = std::numeric_limits<int64_t>::max();
+                for (auto it = ref.lower_bound(lo); it != ref.end() && *it <= hi; ++it) {
+                    want_sum += *it;
+                    want_min = std::min(want_min, *it);
+                }
+                Check(sum.QueryRange(lo, hi) == want_sum, "QueryRange sum");
+                Check(mn.QueryRange(lo, hi) == want_min, "QueryRange min");
+            }
+        }
+        if (i % 10000 == 0) {
+            Check(sum.Validate() && mn.Validate(), "Validate augmented");
+        }
+    }
+    std::printf("%-28s %8zu ops    final size %6zu  %s\n",
+                "QueryRange", iterations, ref.size(), g_failures ? "FAIL" : "ok");
+}
+
+// Serialize -> Deserialize round-trip and a TFlatTreeView over the same
+// bytes, probed against the source tree.
+void StressSerialization(uint64_t seed) {
+    TAvlTree<int64_t, false> src;
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < 20000; ++i) {
+        src.Insert((int64_t)(rng() % 100000));
+    }
+    std::stringstream dump;
+    src.Serialize(dump);
+    TAvlTree<int64_t, false> restored;
+    Check(restored.Deserialize(dump), "Deserialize");
+    Check(restored.Size() == src.Size() && restored.Validate(), "round-trip size");
+    auto rit = restored.Begin();
+    for (auto it = src.Begin(); it != src.End(); ++it, ++rit) {
+        if (rit == restored.End() || *it != *rit) {
+            Check(false, "round-trip contents");
+            break;
+        }
+    }
+
+    std::string bytes = [&] { std::stringstream out; src.Serialize(out); return out.str(); }();
+    TFlatTreeView<int64_t> view;
+    Check(view.Attach(bytes.data(), bytes.size()) && view.Size() == src.Size(), "view Attach");
+    for (size_t i = 0; i < 2000; ++i) {
+        int64_t v = (int64_t)(rng() % 100000);
+        Check(view.Exsist(v) == src.Exsist(v), "view Exsist");
+        auto next = src.Next(v);
+        const int64_t* vnext = view.Next(v);
+        Check(next.IsValid() == (vnext != nullptr) && (!vnext || *next == *vnext), "view Next");
+    }
+    Check(!view.Attach(bytes.data(), bytes.size() - 1), "truncated dump rejected");
+    std::printf("%-28s %8zu keys   %s\n", "serialization", src.Size(), g_failures ? "FAIL" : "ok");
+}
+
+// the flat point engines share the Insert/Erase/Exsist/Next/Prev surface
+// but none of the multiset/tombstone machinery
+template<typename Tree>
+void StressPointEngine(const char* name, size_t iterations, uint64_t seed) {
+    Tree tree;
+    std::set<int64_t> ref;
+    std::mt19937_64 rng(seed);
+    const int64_t range = 1 + (int64_t)(rng() % 2000);
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t v = (int64_t)(rng() % range);
+        switch (rng() % 8) {
+            case 0: case 1: case 2: case 3:
+                tree.Insert(v);
+                ref.insert(v);
+                break;
+            case 4: case 5:
+                tree.Erase(v);
+                ref.erase(v);
+                break;
+            case 6: {
+                auto next = tree.Next(v);
+                auto it = ref.upper_bound(v);
+                Check(next.IsValid() == (it != ref.end()), "engine Next validity");
+                if (next.IsValid() && it != ref.end()) {
+                    Check(*next == *it, "engine Next value");
+                }
+                break;
+            }
+            default:
+                Check(tree.Exsist(v) == (ref.count(v) != 0), "engine Exsist");
+        }
+        Check(tree.Size() == ref.size(), "engine Size");
+    }
+    auto rit = ref.begin();
+    for (auto it = tree.Begin(); it != tree.End(); ++it, ++rit) {
+        if (rit == ref.end() || *it != *rit) {
+            Check(false, "engine in-order contents");
+            break;
+        }
+    }
+    Check(rit == ref.end(), "engine in-order length");
+    std::printf("%-28s %8zu ops    final size %6zu  %s\n",
+                name, iterations, ref.size(), g_failures ? "FAIL" : "ok");
+}
+
+// concurrent writers on disjoint key ranges, then a single-threaded
+// mixed-operation pass against std::set
+void StressShardedTree(size_t iterations, uint64_t seed) {
+    TShardedAvlTree<int64_t, false> tree({2500, 5000, 7500});
+    const size_t kThreads = 4;
+    std::vector<std::thread> workers;
+    for (size_t t = 0; t < kThreads; ++t) {
+        workers.emplace_back([&tree, t] {
+            for (int64_t v = 0; v < 2500; ++v) {
+                tree.Insert((int64_t)t * 2500 + v);
+            }
+        });
+    }
+    for (auto& worker : workers) {
+        worker.join();
+    }
+    Check(tree.Size() == kThreads * 2500, "sharded concurrent size");
+
+    std::set<int64_t> ref;
+    for (int64_t v = 0; v < (int64_t)(kThreads * 2500); ++v) ref.insert(v);
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t v = (int64_t)(rng() % 11000) - 500; // probe outside the shards too
+        switch (rng() % 6) {
+            case 0: case 1:
+                tree.Insert(v);
+                ref.insert(v);
+                break;
+            case 2:
+                tree.Erase(v);
+                ref.erase(v);
+                break;
+            case 3: {
+                auto next = tree.Next(v);
+                auto it = ref.upper_bound(v);
+                Check(next.has_value() == (it != ref.end()), "sharded Next validity");
+                if (next && it != ref.end()) {
+                    Check(*next == *it, "sharded Next value");
+                }
+                break;
+            }
+            case 4: {
+                auto prev = tree.Prev(v);
+                auto it = ref.lower_bound(v);
+                Check(prev.has_value() == (it != ref.begin()), "sharded Prev validity");
+                if (prev && it != ref.begin()) {
+                    Check(*prev == *std::prev(it), "sharded Prev value");
+                }
+                break;
+            }
+            default:
+                Check(tree.Exsist(v) == (ref.count(v) != 0), "sharded Exsist");
+        }
+        Check(tree.Size() == ref.size(), "sharded Size");
+    }
+    std::printf("%-28s %8zu ops    final size %6zu  %s\n",
+                "TShardedAvlTree", iterations, ref.size(), g_failures ? "FAIL" : "ok");
+}
+
+// a writer mutates while a reader keeps snapshotting: every snapshot must be
+// internally consistent (sorted, size matching ForEach) regardless of timing
+void StressCowTree(size_t iterations, uint64_t seed) {
+    TCowAvlTree<int64_t> tree;
+    std::thread reader([&tree, iterations] {
+        for (size_t i = 0; i < iterations / 4; ++i) {
+            auto snap = tree.Snapshot();
+            size_t seen = 0;
+            int64_t prev = std::numeric_limits<int64_t>::min();
+            snap.ForEach([&](const int64_t& v) {
+                Check(prev < v, "snapshot sorted");
+                prev = v;
+                seen += 1;
+            });
+            Check(seen == snap.Size(), "snapshot size consistent");
+        }
+    });
+    std::mt19937_64 rng(seed);
+    std::set<int64_t> ref;
+    for (size_t i = 0; i < iterations; ++i) {
+        int64_t v = (int64_t)(rng() % 3000);
+        if (rng() % 3 != 0) {
+            tree.Insert(v);
+            ref.insert(v);
+        } else {
+            tree.Erase(v);
+            ref.erase(v);
+        }
+    }
+    reader.join();
+    auto snap = tree.Snapshot();
+    Check(snap.Size() == ref.size(), "COW final size");
+    for (auto v : ref) {
+        if (!snap.Exsist(v)) {
+            Check(false, "COW final contents");
+            break;
+        }
+    }
+    std::printf("%-28s %8zu ops    final size %6zu  %s\n",
+                "TCowAvlTree", iterations, ref.size(), g_failures ? "FAIL" : "ok");
+}
+
+// every retained version must stay frozen while later versions keep mutating
+void StressPersistentTree(size_t versions, uint64_t seed) {
+    std::vector<TPersistentAvlTree<int64_t>> chain{{}};
+    std::vector<std::set<int64_t>> refs{{}};
+    std::mt19937_64 rng(seed);
+    for (size_t i = 0; i < versions; ++i) {
+        int64_t v = (int64_t)(rng() % 300);
+        auto ref = refs.back();
+        if (rng() % 3 == 0) {
+            chain.push_back(chain.back().Erase(v));
+            ref.erase(v);
+        } else {
+            chain.push_back(chain.back().Insert(v));
+            ref.insert(v);
+        }
+        refs.push_back(std::move(ref));
+    }
+    for (size_t i = 0; i < chain.size(); i += 1 + i / 16) {
+        Check(chain[i].Size() == refs[i].size(), "version size");
+        size_t seen = 0;
+        bool match = true;
+        auto rit = refs[i].begin();
+        chain[i].ForEach([&](const int64_t& v) {
+            if (rit == refs[i].end() || *rit != v) match = false; else ++rit;
+            seen += 1;
+        });
+        Check(match && seen == refs[i].size(), "version contents frozen");
+    }
+    std::printf("%-28s %8zu versions  %s\n",
+                "TPersistentAvlTree", versions, g_failures ? "FAIL" : "ok");
+}
+
+// the bugs that motivated this harness
+void RegressionCases() {
+    // erasing the last element used to dereference a null root_
+    TSearchTree<int64_t, false> last;
+    last.Insert(7);
+    last.Erase(7);
+    last.Erase(7); // and erasing from the now-empty tree too
+    Check(last.Validate() && last.Empty(), "erase-last-element");
+
+    // sorted insertions must stay balanced (signed HeightDiff)
+    TAvlTree<int64_t, false> sorted;
+    for (int64_t v = 0; v < 100000; ++v) {
+        sorted.Insert(v);
+    }
+    Check(sorted.Validate(), "sorted-insert balance");
+
+    // a forged flat-dump header whose count_ * sizeof(T) wraps to something
+    // small must be rejected, by the view and by Deserialize alike
+    TFlatTreeHeader forged{};
+    std::memcpy(forged.magic_, TFlatTreeHeader::kMagic, sizeof(forged.magic_));
+    forged.count_ = 1ULL << 61;
+    forged.value_size_ = sizeof(int64_t);
+    char buf[sizeof(forged) + 8] = {};
+    std::memcpy(buf, &forged, sizeof(forged));
+    TFlatTreeView<int64_t> view;
+    Check(!view.Attach(buf, sizeof(buf)), "forged count rejected by Attach");
+    std::stringstream forged_stream(std::string(buf, sizeof(buf)));
+    TAvlTree<int64_t, false> victim;
+    Check(!victim.Deserialize(forged_stream), "forged count rejected by Deserialize");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    size_t iterations = 1000 * 1000;
+    if (argc > 1) {
+        iterations = std::strtoull(argv[1], nullptr, 10);
+    }
+
+    RegressionCases();
+
+    std::random_device rd;
+    uint64_t seed = ((uint64_t)rd() << 32) | rd();
+    std::printf("seed %llu\n", (unsigned long long)seed);
+
+    StressVariant<TSearchTree<int64_t, false>, false>("TSearchTree/set", iterations, seed);
+    StressVariant<TSearchTree<int64_t, true>, true>("TSearchTree/multiset", iterations, seed + 1);
+    StressVariant<TAvlTree<int64_t, false>, false>("TAvlTree/set", iterations, seed + 2);
+    StressVariant<TAvlTree<int64_t, true>, true>("TAvlTree/multiset", iterations, seed + 3);
+    StressVariant<TArenaAvlTree<int64_t, false>, false>("TArenaAvlTree/set", iterations, seed + 4);
+    StressVariant<TAvlTreeWithSize<int64_t, false>, false>("TAvlTreeWithSize/set", iterations, seed + 5);
+    StressVariant<TAvlTreeWithSize<int64_t, true>, true>("TAvlTreeWithSize/multiset", iterations, seed + 6);
+    StressVariant<TAvlTreeAugmented<int64_t, TSumMonoid<int64_t>>, false>("TAvlTreeAugmented/sum", iterations, seed + 7);
+
+    // the surfaces the per-variant loop cannot reach
+    size_t scaled = std::max<size_t>(iterations / 10, 1000);
+    StressJoinSplit<TAvlTree<int64_t, false>, false>("JoinSplit/set", std::max<size_t>(iterations / 2000, 50), seed + 8);
+    StressJoinSplit<TAvlTree<int64_t, true>, true>("JoinSplit/multiset", std::max<size_t>(iterations / 2000, 50), seed + 9);
+    StressJoinSplit<TAvlTreeWithSize<int64_t, false>, false>("JoinSplit/with-size", std::max<size_t>(iterations / 2000, 50), seed + 10);
+    StressOrderStatistics(scaled, seed + 11);
+    StressQueryRange(scaled, seed + 12);
+    StressSerialization(seed + 13);
+    StressPointEngine<TCompactSearchTree<int64_t>>("TCompactSearchTree", scaled, seed + 14);
+    StressPointEngine<TLeafArrayTree<int64_t>>("TLeafArrayTree", scaled, seed + 15);
+    StressShardedTree(scaled, seed + 16);
+    StressCowTree(scaled, seed + 17);
+    StressPersistentTree(std::max<size_t>(iterations / 500, 100), seed + 18);
+
+    return g_failures ? 1 : 0;
+}